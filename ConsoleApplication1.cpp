@@ -5,11 +5,90 @@
 #define EXP_HALF_NUM_BITS 48
 #define REDUCTION_NUM_BITS 56
 #define REDUCTION_HALF_NUM_BITS 28
+#define BLOCK_BYTES 8
+#define KEY_LANES 8
+
+#ifndef DES_ALLOC_TRACKING
+#define DES_ALLOC_TRACKING 0
+#endif
+#ifndef DES_USDT_PROBES
+#define DES_USDT_PROBES 0
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define DES_HAS_COROUTINES 1
+#else
+#define DES_HAS_COROUTINES 0
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+struct iovec {
+    void* iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#define DES_HAS_DAEMON 1
+#else
+#define DES_HAS_DAEMON 0
+#endif
+
+// USDT/SDT probes for perf and bpftrace (provider "des"). Build with DES_USDT_PROBES=1 and
+// <sys/sdt.h> available to get them; by default the macros expand to nothing and their
+// arguments are not evaluated. Probes and arguments:
+//   key_setup(keys, threads)                  building key schedules
+//   batch_start / batch_end(requests, mode, engine)
+//   mode_entry / mode_exit(mode, decrypt, blocks, engine)
+//   task_dispatch(worker, first block, blocks, batch)   scheduler task taken by a worker
+//   pool_dispatch(tasks, threads)             parallel_for fan-out
+#if DES_USDT_PROBES
+#include <sys/sdt.h>
+#define DES_PROBE2(name, a, b) DTRACE_PROBE2(des, name, a, b)
+#define DES_PROBE3(name, a, b, c) DTRACE_PROBE3(des, name, a, b, c)
+#define DES_PROBE4(name, a, b, c, d) DTRACE_PROBE4(des, name, a, b, c, d)
+#else
+#define DES_PROBE2(name, a, b) ((void)0)
+#define DES_PROBE3(name, a, b, c) ((void)0)
+#define DES_PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+// engine ids reported by the probes
+#define ENGINE_SCALAR 0
+#define ENGINE_SIMD 1
 
 
 //// -----------------------tables part-----------------------
@@ -208,6 +287,266 @@ const int P_Table[HALF_NUM_BITS] = {
     22, 11,  4, 25
 };
 
+//// -----------------------allocation part-----------------------
+//
+// Every allocation in this file goes through des_malloc, des_calloc, des_realloc and
+// des_free. Build with DES_ALLOC_TRACKING=1 to count allocations, bytes, live bytes and
+// peak live bytes, both globally and per operation (see alloc_scope_begin). Tracking
+// also replaces the global operator new and delete with these hooks, so objects created
+// with new and the memory of the std containers and threads are counted as well. A scope
+// counts the thread that began it and the parallel_for workers that thread starts; the
+// long-lived threads (scheduler workers, prefetcher, stream pipeline, daemon) are only
+// counted process wide. Without tracking the hooks are plain calls to the C library.
+
+
+/// <summary>
+/// Allocation counters, either process wide or for one operation.
+/// </summary>
+typedef struct alloc_stats {
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t bytes;
+    int64_t live_bytes;
+    int64_t peak_bytes;
+} alloc_stats;
+
+#if DES_ALLOC_TRACKING
+
+#define ALLOC_HEADER_SIZE 16
+
+// the replaced operators stay out of line, so the compiler never sees free() on a pointer from new
+#ifdef _MSC_VER
+#define ALLOC_NOINLINE __declspec(noinline)
+#else
+#define ALLOC_NOINLINE __attribute__((noinline))
+#endif
+
+static std::atomic<uint64_t> alloc_total_allocations(0);
+static std::atomic<uint64_t> alloc_total_frees(0);
+static std::atomic<uint64_t> alloc_total_bytes(0);
+static std::atomic<int64_t> alloc_total_live_bytes(0);
+static std::atomic<int64_t> alloc_total_peak_bytes(0);
+static thread_local alloc_stats* alloc_current_scope = NULL;
+static std::mutex alloc_scope_lock;
+
+
+/// <summary>
+/// Records an allocation (positive size) or a release (negative size).
+/// </summary>
+static void alloc_record(int64_t size) {
+    if (size >= 0) {
+        alloc_total_allocations++;
+        alloc_total_bytes += size;
+    }
+    else {
+        alloc_total_frees++;
+    }
+    int64_t live = alloc_total_live_bytes += size;
+    int64_t peak = alloc_total_peak_bytes;
+    while (live > peak && !alloc_total_peak_bytes.compare_exchange_weak(peak, live)) {
+    }
+
+    alloc_stats* scope = alloc_current_scope;
+    if (scope != NULL) {
+        // parallel_for workers share the scope of the thread that started them
+        std::lock_guard<std::mutex> guard(alloc_scope_lock);
+        if (size >= 0) {
+            scope->allocations++;
+            scope->bytes += size;
+        }
+        else {
+            scope->frees++;
+        }
+        scope->live_bytes += size;
+        if (scope->live_bytes > scope->peak_bytes) {
+            scope->peak_bytes = scope->live_bytes;
+        }
+    }
+}
+
+
+/// <summary>
+/// Tracked malloc. The requested size is kept in a header in front of the returned block.
+/// </summary>
+void* des_malloc(size_t size) {
+    if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+        return NULL;
+    }
+    unsigned char* block = (unsigned char*)malloc(size + ALLOC_HEADER_SIZE);
+    if (block == NULL) {
+        return NULL;
+    }
+    *(size_t*)block = size;
+    alloc_record((int64_t)size);
+    return block + ALLOC_HEADER_SIZE;
+}
+
+
+/// <summary>
+/// Tracked calloc.
+/// </summary>
+void* des_calloc(size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - ALLOC_HEADER_SIZE) / size) {
+        return NULL;
+    }
+    void* block = des_malloc(count * size);
+    if (block != NULL) {
+        memset(block, 0, count * size);
+    }
+    return block;
+}
+
+
+/// <summary>
+/// Tracked free.
+/// </summary>
+void des_free(void* pointer) {
+    if (pointer == NULL) {
+        return;
+    }
+    unsigned char* block = (unsigned char*)pointer - ALLOC_HEADER_SIZE;
+    alloc_record(-(int64_t)*(size_t*)block);
+    free(block);
+}
+
+
+/// <summary>
+/// Tracked realloc. Counted as a release of the old block and an allocation of the new one.
+/// </summary>
+void* des_realloc(void* pointer, size_t size) {
+    if (pointer == NULL) {
+        return des_malloc(size);
+    }
+    if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+        return NULL;
+    }
+    unsigned char* block = (unsigned char*)pointer - ALLOC_HEADER_SIZE;
+    size_t old_size = *(size_t*)block;
+    unsigned char* resized = (unsigned char*)realloc(block, size + ALLOC_HEADER_SIZE);
+    if (resized == NULL) {
+        return NULL;
+    }
+    *(size_t*)resized = size;
+    alloc_record(-(int64_t)old_size);
+    alloc_record((int64_t)size);
+    return resized + ALLOC_HEADER_SIZE;
+}
+
+
+/// <summary>
+/// Reads the process wide counters.
+/// </summary>
+void alloc_stats_query(alloc_stats* stats) {
+    stats->allocations = alloc_total_allocations;
+    stats->frees = alloc_total_frees;
+    stats->bytes = alloc_total_bytes;
+    stats->live_bytes = alloc_total_live_bytes;
+    stats->peak_bytes = alloc_total_peak_bytes;
+}
+
+
+/// <summary>
+/// Starts counting the allocations of the calling thread into scope (which is zeroed).
+/// </summary>
+/// <returns>The previous scope, to be passed to alloc_scope_end</returns>
+alloc_stats* alloc_scope_begin(alloc_stats* scope) {
+    memset(scope, 0, sizeof(alloc_stats));
+    alloc_stats* previous = alloc_current_scope;
+    alloc_current_scope = scope;
+    return previous;
+}
+
+
+/// <summary>
+/// Stops counting into the current scope and restores the previous one.
+/// </summary>
+void alloc_scope_end(alloc_stats* previous) {
+    alloc_current_scope = previous;
+}
+
+
+/// <summary>
+/// Returns the scope the calling thread counts into, NULL if none.
+/// </summary>
+alloc_stats* alloc_scope_current() {
+    return alloc_current_scope;
+}
+
+
+/// <summary>
+/// Makes the calling thread count into an existing scope without resetting it.
+/// </summary>
+void alloc_scope_attach(alloc_stats* scope) {
+    alloc_current_scope = scope;
+}
+
+
+/// <summary>
+/// Tracked operator new, see des_malloc.
+/// </summary>
+ALLOC_NOINLINE void* operator new(size_t size) {
+    void* block = des_malloc(size == 0 ? 1 : size);
+    if (block == NULL) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+ALLOC_NOINLINE void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+ALLOC_NOINLINE void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return des_malloc(size == 0 ? 1 : size);
+}
+
+ALLOC_NOINLINE void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return des_malloc(size == 0 ? 1 : size);
+}
+
+
+/// <summary>
+/// Tracked operator delete, see des_free.
+/// </summary>
+ALLOC_NOINLINE void operator delete(void* pointer) noexcept {
+    des_free(pointer);
+}
+
+ALLOC_NOINLINE void operator delete[](void* pointer) noexcept {
+    des_free(pointer);
+}
+
+ALLOC_NOINLINE void operator delete(void* pointer, size_t) noexcept {
+    des_free(pointer);
+}
+
+ALLOC_NOINLINE void operator delete[](void* pointer, size_t) noexcept {
+    des_free(pointer);
+}
+
+ALLOC_NOINLINE void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+    des_free(pointer);
+}
+
+ALLOC_NOINLINE void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+    des_free(pointer);
+}
+
+#else
+
+static inline void* des_malloc(size_t size) { return malloc(size); }
+static inline void* des_calloc(size_t count, size_t size) { return calloc(count, size); }
+static inline void* des_realloc(void* pointer, size_t size) { return realloc(pointer, size); }
+static inline void des_free(void* pointer) { free(pointer); }
+void alloc_stats_query(alloc_stats* stats) { memset(stats, 0, sizeof(alloc_stats)); }
+alloc_stats* alloc_scope_begin(alloc_stats* scope) { memset(scope, 0, sizeof(alloc_stats)); return NULL; }
+void alloc_scope_end(alloc_stats* previous) { (void)previous; }
+alloc_stats* alloc_scope_current() { return NULL; }
+void alloc_scope_attach(alloc_stats* scope) { (void)scope; }
+
+#endif
+
+
 //// -----------------------functions part-----------------------
 
 
@@ -217,7 +556,7 @@ const int P_Table[HALF_NUM_BITS] = {
 /// <param name="input">The input string to be padded.</param>
 /// <param name="padded_length">The length of the padded string (output parameter).</param>
 /// <returns>A dynamically allocated string containing the padded input string.</returns>
-/// <remarks>The returned string must be freed using the free() function when it is no longer needed
+/// <remarks>The returned string must be freed using the des_free() function when it is no longer needed
 ///          to avoid memory leaks.</remarks>
 /// <remarks>The caller is responsible for managing the memory allocated for the returned string.</remarks>
 /// <remarks>The length of the input string should be less than or equal to INT_MAX / 2 to avoid
@@ -226,7 +565,7 @@ char* pad_string(const char* input) {
     int input_length = strlen(input);
     int padding_length = (QUARTER_NUM_BITS - (input_length % QUARTER_NUM_BITS)) % QUARTER_NUM_BITS; // Calculate the required padding
     int padded_length = input_length + padding_length; // Calculate the padded length
-    char* padded_string = (char*)malloc((padded_length + 1) * sizeof(char)); // Allocate memory for the padded string
+    char* padded_string = (char*)des_malloc((padded_length + 1) * sizeof(char)); // Allocate memory for the padded string
     if (padded_string == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -279,14 +618,14 @@ void print_hex_as_binary(const char* hex_str) {
 /// <returns>Array of pointers to blocks of data</returns>
 /// <remarks>Memory allocation is performed internally and must be freed by the caller.</remarks>
 char** create_blocks_from_data(char* data, int chunks) {
-    char** dataArr = (char**)malloc(sizeof(char*) * chunks);
+    char** dataArr = (char**)des_malloc(sizeof(char*) * chunks);
     if (dataArr == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
     }
 
     for (int i = 0; i < chunks; i++) {
-        dataArr[i] = (char*)malloc((NUM_BITS + 1) * sizeof(char));
+        dataArr[i] = (char*)des_malloc((NUM_BITS + 1) * sizeof(char));
         if (dataArr[i] == NULL) {
             fprintf(stderr, "Memory allocation failed.\n");
             return NULL;
@@ -315,7 +654,7 @@ char* concatenate_blocks(char** dataArr, int chunks) {
         total_length += strlen(dataArr[i]);
     }
 
-    char* concatenated = (char*)malloc((total_length + 1) * sizeof(char));
+    char* concatenated = (char*)des_malloc((total_length + 1) * sizeof(char));
     if (concatenated == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -340,7 +679,7 @@ char* concatenate_blocks(char** dataArr, int chunks) {
 /// <remarks>The caller is responsible for freeing the memory allocated for the returned string.</remarks>
 char* get_ascii_hex(const char* input) {
     int len = strlen(input);
-    char* output = (char*)malloc(len * 2 + 1);
+    char* output = (char*)des_malloc(len * 2 + 1);
     if (output == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -366,7 +705,7 @@ char* get_hex_ascii(const char* input) {
     if (len % 2 != 0) {
         return NULL;
     }
-    char* output = (char*)malloc(len / 2 + 1);
+    char* output = (char*)des_malloc(len / 2 + 1);
     if (output == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -411,7 +750,7 @@ unsigned int hex_char_to_int(char c) {
 /// <remarks>Memory is allocated internally for the binary string and must be freed by the caller.</remarks>
 char* hex_to_binary(const char* hex_str) {
     int len = strlen(hex_str);
-    char* binary_str = (char*)malloc((len * 4 + 1) * sizeof(char));
+    char* binary_str = (char*)des_malloc((len * 4 + 1) * sizeof(char));
     if (binary_str == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -422,7 +761,7 @@ char* hex_to_binary(const char* hex_str) {
         char hex_char = *hex_str;
         int decimal = hex_char_to_int(hex_char);
         if (decimal == -1) {
-            free(binary_str);
+            des_free(binary_str);
             return NULL;
         }
         for (int i = 3; i >= 0; i--) {
@@ -444,7 +783,7 @@ char* hex_to_binary(const char* hex_str) {
 char* binary_to_hex(const char* bin_key) {
     size_t bin_len = strlen(bin_key);
     size_t hex_len = bin_len / 4;
-    char* hex_key = (char*)malloc(hex_len + 1);
+    char* hex_key = (char*)des_malloc(hex_len + 1);
     if (hex_key == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -476,7 +815,7 @@ char* binary_to_hex(const char* bin_key) {
 /// <remarks>Memory is allocated internally for the resulting key and must be freed by the caller.</remarks>
 char* doPC1(const char* key) {
     int index;
-    char* pc1_key = (char*)malloc((REDUCTION_NUM_BITS + 1) * sizeof(char)); // 56 bits => 7 bytes + 1 for null terminator
+    char* pc1_key = (char*)des_malloc((REDUCTION_NUM_BITS + 1) * sizeof(char)); // 56 bits => 7 bytes + 1 for null terminator
     if (pc1_key == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -498,7 +837,7 @@ char* doPC1(const char* key) {
 /// <returns>48-bit key after PC2 permutation</returns>
 /// <remarks>Memory is allocated internally for the resulting key and must be freed by the caller.</remarks>
 char* do_PC2(char* key) {
-    char* pc2_key = (char*)malloc((EXP_HALF_NUM_BITS + 1) * sizeof(char));
+    char* pc2_key = (char*)des_malloc((EXP_HALF_NUM_BITS + 1) * sizeof(char));
     if (pc2_key == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -519,7 +858,7 @@ char* do_PC2(char* key) {
 /// <returns>Array of 48-bit keys after PC2 permutation for each round</returns>
 /// <remarks>Memory is allocated internally for the resulting array and keys, and must be freed by the caller.</remarks>
 char** apply_PC2_to_keys(char** keys_arr) {
-    char** pc2_keys_arr = (char**)malloc(QUARTER_NUM_BITS * sizeof(char*));
+    char** pc2_keys_arr = (char**)des_malloc(QUARTER_NUM_BITS * sizeof(char*));
     if (pc2_keys_arr == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -541,7 +880,7 @@ char** apply_PC2_to_keys(char** keys_arr) {
 /// <returns>Data block after IP permutation</returns>
 /// <remarks>Memory is allocated internally for the resulting data block and must be freed by the caller.</remarks>
 char* apply_IP_to_data_block(char* data) {
-    char* IP_data = (char*)malloc((NUM_BITS + 1) * sizeof(char)); // NUM_BITS bits + null terminator
+    char* IP_data = (char*)des_malloc((NUM_BITS + 1) * sizeof(char)); // NUM_BITS bits + null terminator
     if (IP_data == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -564,7 +903,7 @@ char* apply_IP_to_data_block(char* data) {
 /// <returns>Data block after reverse IP permutation</returns>
 /// <remarks>Memory is allocated internally for the resulting data block and must be freed by the caller.</remarks>
 char* apply_reverse_IP_to_data_block(char* data) {
-    char* IP_data = (char*)malloc((NUM_BITS + 1) * sizeof(char));
+    char* IP_data = (char*)des_malloc((NUM_BITS + 1) * sizeof(char));
     if (IP_data == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -588,7 +927,7 @@ char* apply_reverse_IP_to_data_block(char* data) {
 /// <returns>Array of data blocks after IP permutation</returns>
 /// <remarks>Memory is allocated internally for the resulting array and data blocks, and must be freed by the caller.</remarks>
 char** apply_IP_to_data_array(char** dataArr, int chunks) {
-    char** IP_data_arr = (char**)malloc(chunks * sizeof(char*));
+    char** IP_data_arr = (char**)des_malloc(chunks * sizeof(char*));
     if (IP_data_arr == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -611,7 +950,7 @@ char** apply_IP_to_data_array(char** dataArr, int chunks) {
 /// <returns>Array of data blocks after reverse IP permutation</returns>
 /// <remarks>Memory is allocated internally for the resulting array and data blocks, and must be freed by the caller.</remarks>
 char** apply_reverse_IP_to_data_array(char** dataArr, int chunks) {
-    char** IP_data_arr = (char**)malloc(chunks * sizeof(char*));
+    char** IP_data_arr = (char**)des_malloc(chunks * sizeof(char*));
     if (IP_data_arr == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         exit(EXIT_FAILURE);
@@ -632,9 +971,9 @@ char** apply_reverse_IP_to_data_array(char** dataArr, int chunks) {
 /// <param name="num_keys">Number of keys in the array</param>
 void free_keys_array(char** keys_arr, int num_keys) {
     for (int i = 0; i < num_keys; i++) {
-        free(keys_arr[i]);
+        des_free(keys_arr[i]);
     }
-    free(keys_arr);
+    des_free(keys_arr);
 }
 
 
@@ -647,7 +986,7 @@ void free_keys_array(char** keys_arr, int num_keys) {
 /// <remarks>Memory is allocated internally for the rotated key and must be freed by the caller.</remarks>
 char* rotate_left(const char* key, int rotations) {
     int length = strlen(key);
-    char* rotated_key = (char*)malloc((length + 1) * sizeof(char));
+    char* rotated_key = (char*)des_malloc((length + 1) * sizeof(char));
     if (rotated_key == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -669,14 +1008,14 @@ char* rotate_left(const char* key, int rotations) {
 /// <returns>Array of half keys</returns>
 /// <remarks>Memory is allocated internally for the array and keys, and must be freed by the caller.</remarks>
 char** generate_half_keys(char* first_key) {
-    char** half_keys = (char**)malloc(QUARTER_NUM_BITS * sizeof(char*));
+    char** half_keys = (char**)des_malloc(QUARTER_NUM_BITS * sizeof(char*));
     if (half_keys == NULL) {
         printf("Memory allocation failed!\n");
         return NULL;
     }
 
     for (int i = 0; i < QUARTER_NUM_BITS; i++) {
-        half_keys[i] = (char*)malloc(REDUCTION_HALF_NUM_BITS * sizeof(char));
+        half_keys[i] = (char*)des_malloc(REDUCTION_HALF_NUM_BITS * sizeof(char));
         if (half_keys[i] == NULL) {
             printf("Memory allocation failed!\n");
             return NULL;
@@ -699,13 +1038,13 @@ char** generate_half_keys(char* first_key) {
 /// <returns>Array of full keys</returns>
 /// <remarks>Memory is allocated internally for the array and keys, and must be freed by the caller.</remarks>
 char** generate_keys_arr(char** left_half_keys, char** right_half_keys) {
-    char** keys = (char**)malloc(QUARTER_NUM_BITS * sizeof(char*));
+    char** keys = (char**)des_malloc(QUARTER_NUM_BITS * sizeof(char*));
     if (keys == NULL) {
         printf("Memory allocation failed!\n");
         return NULL;
     }
     for (int i = 0; i < QUARTER_NUM_BITS; i++) {
-        keys[i] = (char*)malloc(57 * sizeof(char));
+        keys[i] = (char*)des_malloc(57 * sizeof(char));
         if (keys[i] == NULL) {
             printf("Memory allocation failed!\n");
             return NULL;
@@ -748,7 +1087,7 @@ const char* hex_to_binary_char(char hex) {
 /// <returns>Result of the XOR operation</returns>
 /// <remarks>Memory is allocated internally for the result and must be freed by the caller.</remarks>
 char* binary_xor(const char* num1, const char* num2, size_t length) {
-    char* result = (char*)malloc(length + 1);
+    char* result = (char*)des_malloc(length + 1);
     if (result == NULL) {
         printf("Memory allocation failed!\n");
         return NULL;
@@ -770,7 +1109,7 @@ char* binary_xor(const char* num1, const char* num2, size_t length) {
 /// <returns>Data block after permutation P</returns>
 /// <remarks>Memory is allocated internally for the resulting data block and must be freed by the caller.</remarks>
 char* apply_permutation_p(char* data) {
-    char* p_data = (char*)malloc(33 * sizeof(char));
+    char* p_data = (char*)des_malloc(33 * sizeof(char));
     if (p_data == NULL) {
         printf("Memory allocation failed!\n");
         return NULL;
@@ -791,7 +1130,7 @@ char* apply_permutation_p(char* data) {
 /// <returns>Data block after S-box substitution</returns>
 /// <remarks>Memory is allocated internally for the resulting data block and must be freed by the caller.</remarks>
 char* apply_s_boxes(char* data) {
-    char* s_data = (char*)calloc(33, sizeof(char));
+    char* s_data = (char*)des_calloc(33, sizeof(char));
     if (s_data == NULL) {
         printf("Memory allocation failed!\n");
         return NULL;
@@ -815,7 +1154,7 @@ char* apply_s_boxes(char* data) {
 /// <returns>Expanded data block</returns>
 /// <remarks>Memory is allocated internally for the resulting data block and must be freed by the caller.</remarks>
 char* expension(char* data) {
-    char* expanded_data = (char*)malloc((EXP_HALF_NUM_BITS + 1) * sizeof(char));
+    char* expanded_data = (char*)des_malloc((EXP_HALF_NUM_BITS + 1) * sizeof(char));
     if (expanded_data == NULL) {
         printf("Memory allocation failed!\n");
         return NULL;
@@ -836,10 +1175,10 @@ char* expension(char* data) {
 /// <returns>Encrypted data block</returns>
 /// <remarks>Memory is allocated internally for intermediate data blocks and must be freed by the caller.</remarks>
 char* encryption_rounds(char* data, char** keys) {
-    char* result_data = (char*)malloc((NUM_BITS + 1) * sizeof(char));
-    char* right_data = (char*)malloc(33*sizeof(char));
-    char* left_data = (char*)malloc(33*sizeof(char));
-    char* next_left_data = (char*)malloc(33*sizeof(char));
+    char* result_data = (char*)des_malloc((NUM_BITS + 1) * sizeof(char));
+    char* right_data = (char*)des_malloc(33*sizeof(char));
+    char* left_data = (char*)des_malloc(33*sizeof(char));
+    char* next_left_data = (char*)des_malloc(33*sizeof(char));
 
     if (right_data == NULL || left_data == NULL) {
         printf("Memory allocation failed!\n");
@@ -886,10 +1225,10 @@ char* encryption_rounds(char* data, char** keys) {
 /// <returns>Decrypted data block</returns>
 /// <remarks>Memory is allocated internally for intermediate data blocks and must be freed by the caller.</remarks>
 char* decryption_rounds(char* data, char** keys) {
-    char* result_data = (char*)malloc((NUM_BITS + 1) * sizeof(char));
-    char* right_data = (char*)malloc(33 * sizeof(char));
-    char* left_data = (char*)malloc(33 * sizeof(char));
-    char* next_left_data = (char*)malloc(33 * sizeof(char));
+    char* result_data = (char*)des_malloc((NUM_BITS + 1) * sizeof(char));
+    char* right_data = (char*)des_malloc(33 * sizeof(char));
+    char* left_data = (char*)des_malloc(33 * sizeof(char));
+    char* next_left_data = (char*)des_malloc(33 * sizeof(char));
 
     if (right_data == NULL || left_data == NULL) {
         printf("Memory allocation failed!\n");
@@ -941,7 +1280,6180 @@ void printRows(char** array, int numRows) {
     }
 }
 
-int main() {
+//// -----------------------block engine part-----------------------
+
+
+/// <summary>
+/// Packed key schedule used by the block engine. Each round key holds the 48 bits
+/// selected by PC2, right aligned in a 64-bit word. split_subkeys holds the same bits
+/// pre-split into S-Box fields, so the rounds need no E-expansion: word 0 has the 6 key
+/// bits of S-Boxes 1, 3, 5 and 7 in bits 24-29, 16-21, 8-13 and 0-5, lined up with R
+/// rotated right by 3; word 1 has those of S-Boxes 2, 4, 6 and 8, lined up with R rotated
+/// left by 1.
+/// </summary>
+typedef struct des_key_schedule {
+    uint64_t subkeys[QUARTER_NUM_BITS];
+    uint32_t split_subkeys[QUARTER_NUM_BITS][2];
+} des_key_schedule;
+
+
+/// <summary>
+/// Combined S-Box and P permutation tables. SP_table[i][v] holds the 32-bit output
+/// of S-Box i for the 6-bit input v, already moved through P_Table.
+/// </summary>
+static uint32_t SP_table[8][64];
+
+
+/// <summary>
+/// Byte-indexed forms of PC1_table and PC2_table used by the key setup. Entry [b][v] is the
+/// permuted output of an input whose byte b (counted from the most significant) is v and
+/// whose other bytes are zero, so a permutation is the OR of one lookup per input byte.
+/// </summary>
+static uint64_t PC1_byte_table[BLOCK_BYTES][256];
+static uint64_t PC2_byte_table[REDUCTION_NUM_BITS / 8][256];
+
+static std::once_flag engine_tables_once;
+
+
+/// <summary>
+/// Loads 8 bytes as a big-endian 64-bit value.
+/// </summary>
+/// <param name="bytes">Pointer to the first of 8 bytes</param>
+/// <returns>The packed 64-bit value</returns>
+static uint64_t load_be64(const unsigned char* bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < BLOCK_BYTES; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+
+/// <summary>
+/// Stores a 64-bit value as 8 big-endian bytes.
+/// </summary>
+/// <param name="bytes">Destination of 8 bytes</param>
+/// <param name="value">Value to be stored</param>
+static void store_be64(unsigned char* bytes, uint64_t value) {
+    for (int i = BLOCK_BYTES - 1; i >= 0; i--) {
+        bytes[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+
+/// <summary>
+/// Loads 4 bytes as a big-endian 32-bit value.
+/// </summary>
+static uint32_t load_be32(const unsigned char* bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+
+/// <summary>
+/// Stores a 32-bit value as 4 big-endian bytes.
+/// </summary>
+static void store_be32(unsigned char* bytes, uint32_t value) {
+    bytes[0] = (unsigned char)(value >> 24);
+    bytes[1] = (unsigned char)(value >> 16);
+    bytes[2] = (unsigned char)(value >> 8);
+    bytes[3] = (unsigned char)value;
+}
+
+
+/// <summary>
+/// Rotates a 32-bit word to the right.
+/// </summary>
+static uint32_t rotr32(uint32_t value, int rotations) {
+    return (value >> rotations) | (value << ((32 - rotations) & 31));
+}
+
+
+/// <summary>
+/// Applies one of the DES permutation tables to a packed value. Table entries are
+/// 1-based bit positions counted from the most significant of the input bits.
+/// </summary>
+/// <param name="input">Packed input bits, right aligned</param>
+/// <param name="table">Permutation table (PC1_table, PC2_table, IP_table, ...)</param>
+/// <param name="out_bits">Number of entries in the table</param>
+/// <param name="in_bits">Width of the input in bits</param>
+/// <returns>Permuted bits, right aligned</returns>
+static uint64_t permute_bits(uint64_t input, const int* table, int out_bits, int in_bits) {
+    uint64_t output = 0;
+    for (int i = 0; i < out_bits; i++) {
+        output = (output << 1) | ((input >> (in_bits - table[i])) & 1);
+    }
+    return output;
+}
+
+
+/// <summary>
+/// Builds the byte-indexed form of a permutation table.
+/// </summary>
+/// <param name="table">Permutation table</param>
+/// <param name="out_bits">Number of entries in the table</param>
+/// <param name="in_bits">Width of the input in bits, a multiple of 8</param>
+/// <param name="byte_table">Receives in_bits / 8 rows of 256 entries</param>
+static void build_byte_table(const int* table, int out_bits, int in_bits, uint64_t (*byte_table)[256]) {
+    for (int b = 0; b < in_bits / 8; b++) {
+        for (int v = 0; v < 256; v++) {
+            byte_table[b][v] = permute_bits((uint64_t)v << (in_bits - 8 * (b + 1)), table, out_bits, in_bits);
+        }
+    }
+}
+
+
+/// <summary>
+/// Applies a permutation through its byte-indexed form.
+/// </summary>
+static uint64_t permute_bytes(uint64_t input, const uint64_t (*byte_table)[256], int in_bytes) {
+    uint64_t output = 0;
+    for (int b = 0; b < in_bytes; b++) {
+        output |= byte_table[b][(input >> (8 * (in_bytes - 1 - b))) & 0xFF];
+    }
+    return output;
+}
+
+
+/// <summary>
+/// Builds SP_table and the key setup byte tables from the DES tables.
+/// </summary>
+static void build_engine_tables() {
+    build_byte_table(PC1_table, REDUCTION_NUM_BITS, NUM_BITS, PC1_byte_table);
+    build_byte_table(PC2_table, EXP_HALF_NUM_BITS, REDUCTION_NUM_BITS, PC2_byte_table);
+    for (int s = 0; s < 8; s++) {
+        for (int v = 0; v < 64; v++) {
+            int row = ((v >> 4) & 2) | (v & 1);
+            int column = (v >> 1) & 0xF;
+            uint64_t s_out = (uint64_t)S_Box[s][row][column] << (28 - 4 * s);
+            SP_table[s][v] = (uint32_t)permute_bits(s_out, P_Table, HALF_NUM_BITS, HALF_NUM_BITS);
+        }
+    }
+}
+
+
+/// <summary>
+/// Makes sure the derived engine tables are built. Safe to call from any thread.
+/// </summary>
+void init_engine_tables() {
+    std::call_once(engine_tables_once, build_engine_tables);
+}
+
+
+/// <summary>
+/// Splits a 48-bit round key into the two words of split_subkeys.
+/// </summary>
+static void split_subkey(uint64_t subkey, uint32_t* words) {
+    words[0] = 0;
+    words[1] = 0;
+    for (int s = 0; s < 8; s++) {
+        words[s & 1] |= (uint32_t)((subkey >> (42 - 6 * s)) & 0x3F) << (24 - 8 * (s >> 1));
+    }
+}
+
+
+/// <summary>
+/// Builds the key schedules of up to KEY_LANES keys side by side. This is the packed
+/// equivalent of doPC1, generate_half_keys, generate_keys_arr and apply_PC2_to_keys.
+/// </summary>
+/// <param name="keys">count consecutive 8-byte keys</param>
+/// <param name="count">Number of keys (1 to KEY_LANES)</param>
+/// <param name="schedules">Receives count key schedules</param>
+static void key_setup_lanes(const unsigned char* keys, int count, des_key_schedule* schedules) {
+    uint32_t c_keys[KEY_LANES], d_keys[KEY_LANES];
+    for (int j = 0; j < count; j++) {
+        uint64_t pc1_key = permute_bytes(load_be64(keys + j * BLOCK_BYTES), PC1_byte_table, BLOCK_BYTES);
+        c_keys[j] = (uint32_t)(pc1_key >> REDUCTION_HALF_NUM_BITS) & 0x0FFFFFFF;
+        d_keys[j] = (uint32_t)pc1_key & 0x0FFFFFFF;
+    }
+
+    for (int i = 0; i < QUARTER_NUM_BITS; i++) {
+        int shift = vector[i];
+        for (int j = 0; j < count; j++) {
+            c_keys[j] = ((c_keys[j] << shift) | (c_keys[j] >> (REDUCTION_HALF_NUM_BITS - shift))) & 0x0FFFFFFF;
+            d_keys[j] = ((d_keys[j] << shift) | (d_keys[j] >> (REDUCTION_HALF_NUM_BITS - shift))) & 0x0FFFFFFF;
+            uint64_t cd_key = ((uint64_t)c_keys[j] << REDUCTION_HALF_NUM_BITS) | d_keys[j];
+            schedules[j].subkeys[i] = permute_bytes(cd_key, PC2_byte_table, REDUCTION_NUM_BITS / 8);
+            split_subkey(schedules[j].subkeys[i], schedules[j].split_subkeys[i]);
+        }
+    }
+}
+
+
+/// <summary>
+/// Builds the packed key schedule for an 8-byte key.
+/// </summary>
+/// <param name="key">8-byte key</param>
+/// <param name="schedule">Key schedule to be filled</param>
+void des_key_setup(const unsigned char* key, des_key_schedule* schedule) {
+    init_engine_tables();
+    DES_PROBE2(key_setup, 1, 1);
+    key_setup_lanes(key, 1, schedule);
+}
+
+
+/// <summary>
+/// The Feistel function: expansion, key mixing, S-Boxes and permutation P.
+/// Two rotations of the half put the 6-bit groups of all S-Boxes at byte boundaries, so
+/// with the pre-split round key the expansion and key mixing are two XORs.
+/// </summary>
+/// <param name="right">Right half of the block</param>
+/// <param name="subkey">Round key from split_subkeys</param>
+/// <returns>32-bit output of the Feistel function</returns>
+static inline uint32_t feistel(uint32_t right, const uint32_t* subkey) {
+    uint32_t odd = rotr32(right, 3) ^ subkey[0];
+    uint32_t even = rotr32(right, 31) ^ subkey[1];
+    return SP_table[0][(odd >> 24) & 0x3F] ^ SP_table[2][(odd >> 16) & 0x3F]
+        ^ SP_table[4][(odd >> 8) & 0x3F] ^ SP_table[6][odd & 0x3F]
+        ^ SP_table[1][(even >> 24) & 0x3F] ^ SP_table[3][(even >> 16) & 0x3F]
+        ^ SP_table[5][(even >> 8) & 0x3F] ^ SP_table[7][even & 0x3F];
+}
+
+
+/// <summary>
+/// Applies the Initial Permutation to a block held as two 32-bit halves. Equivalent to
+/// IP_table, done as five swaps of bit groups between the halves instead of 64 bit moves.
+/// </summary>
+/// <param name="left">First 32 bits of the block in, L0 out</param>
+/// <param name="right">Last 32 bits of the block in, R0 out</param>
+static void initial_permutation(uint32_t* left, uint32_t* right) {
+    uint32_t l = *left, r = *right, work;
+    work = ((l >> 4) ^ r) & 0x0F0F0F0F; r ^= work; l ^= work << 4;
+    work = ((l >> 16) ^ r) & 0x0000FFFF; r ^= work; l ^= work << 16;
+    work = ((r >> 2) ^ l) & 0x33333333; l ^= work; r ^= work << 2;
+    work = ((r >> 8) ^ l) & 0x00FF00FF; l ^= work; r ^= work << 8;
+    work = ((l >> 1) ^ r) & 0x55555555; r ^= work; l ^= work << 1;
+    *left = l;
+    *right = r;
+}
+
+
+/// <summary>
+/// Applies the Final Permutation (IP^(-1)): the swaps of initial_permutation in reverse order.
+/// </summary>
+/// <param name="left">First 32 bits of the preoutput block in, of the result out</param>
+/// <param name="right">Last 32 bits of the preoutput block in, of the result out</param>
+static void final_permutation(uint32_t* left, uint32_t* right) {
+    uint32_t l = *left, r = *right, work;
+    work = ((l >> 1) ^ r) & 0x55555555; r ^= work; l ^= work << 1;
+    work = ((r >> 8) ^ l) & 0x00FF00FF; l ^= work; r ^= work << 8;
+    work = ((r >> 2) ^ l) & 0x33333333; l ^= work; r ^= work << 2;
+    work = ((l >> 16) ^ r) & 0x0000FFFF; r ^= work; l ^= work << 16;
+    work = ((l >> 4) ^ r) & 0x0F0F0F0F; r ^= work; l ^= work << 4;
+    *left = l;
+    *right = r;
+}
+
+
+/// <summary>
+/// Fused load: reads 8 big-endian bytes and returns the IP-permuted halves L0 and R0,
+/// replacing get_ascii_hex, pad_string, hex_to_binary, create_blocks_from_data and
+/// apply_IP_to_data_array for one block.
+/// </summary>
+/// <param name="in">8 input bytes</param>
+/// <param name="left">Receives L0</param>
+/// <param name="right">Receives R0</param>
+static inline void des_load_block(const unsigned char* in, uint32_t* left, uint32_t* right) {
+    *left = load_be32(in);
+    *right = load_be32(in + 4);
+    initial_permutation(left, right);
+}
+
+
+/// <summary>
+/// Fused store: applies the Final Permutation to the preoutput halves and writes 8 bytes.
+/// </summary>
+/// <param name="left">First half of the preoutput block (R16)</param>
+/// <param name="right">Second half of the preoutput block (L16)</param>
+/// <param name="out">Receives 8 output bytes</param>
+static inline void des_store_block(uint32_t left, uint32_t right, unsigned char* out) {
+    final_permutation(&left, &right);
+    store_be32(out, left);
+    store_be32(out + 4, right);
+}
+
+
+/// <summary>
+/// Runs the 16 rounds on IP-permuted halves. On return the halves hold the preoutput
+/// block R16 L16, ready for the Final Permutation.
+/// </summary>
+/// <param name="left">L0 in, R16 out</param>
+/// <param name="right">R0 in, L16 out</param>
+/// <param name="schedule">Key schedule built by des_key_setup</param>
+/// <param name="decrypt">Non-zero to apply the round keys in reverse order</param>
+static inline void des_rounds(uint32_t* left, uint32_t* right, const des_key_schedule* schedule, int decrypt) {
+    uint32_t l = *left, r = *right;
+    for (int i = 0; i < QUARTER_NUM_BITS; i++) {
+        uint32_t next_left = r;
+        r = l ^ feistel(r, schedule->split_subkeys[decrypt ? 15 - i : i]);
+        l = next_left;
+    }
+    *left = r;
+    *right = l;
+}
+
+
+/// <summary>
+/// Encrypts or decrypts a single packed 64-bit block.
+/// </summary>
+/// <param name="block">Block to be processed, first byte in the most significant bits</param>
+/// <param name="schedule">Key schedule built by des_key_setup</param>
+/// <param name="decrypt">Non-zero to apply the round keys in reverse order</param>
+/// <returns>The processed block</returns>
+uint64_t des_crypt_block(uint64_t block, const des_key_schedule* schedule, int decrypt) {
+    uint32_t left = (uint32_t)(block >> HALF_NUM_BITS);
+    uint32_t right = (uint32_t)block;
+    initial_permutation(&left, &right);
+    des_rounds(&left, &right, schedule, decrypt);
+    final_permutation(&left, &right);
+    return ((uint64_t)left << HALF_NUM_BITS) | right;
+}
+
+
+/// <summary>
+/// Encrypts or decrypts one 8-byte block straight from input bytes to output bytes,
+/// without any intermediate buffer.
+/// </summary>
+/// <param name="in">8 input bytes</param>
+/// <param name="out">8 output bytes (may be the same as in)</param>
+/// <param name="schedule">Key schedule built by des_key_setup</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+void des_crypt_bytes(const unsigned char* in, unsigned char* out, const des_key_schedule* schedule, int decrypt) {
+    uint32_t left, right;
+    des_load_block(in, &left, &right);
+    des_rounds(&left, &right, schedule, decrypt);
+    des_store_block(left, right, out);
+}
+
+
+//// -----------------------simd kernel part-----------------------
+//
+// Multi-block SP-table kernel: one 32-bit lane per block, SIMD_LANES blocks per register
+// (8 with AVX2, 16 with AVX-512). The 6-bit S-Box indices of all lanes are cut out with
+// vector shifts and the SP_table lookups are done with gathers (vpgatherdd). Unlike a
+// bitsliced kernel it needs only SIMD_LANES blocks in flight, which suits short batches.
+// Compiled in when the build targets AVX2 (-mavx2, /arch:AVX2) or AVX-512 (-mavx512f,
+// /arch:AVX512); otherwise SIMD_LANES is 0 and the scalar code is used.
+
+#if defined(__AVX512F__)
+#define SIMD_LANES 16
+typedef __m512i simd_word;
+#define simd_load(p) _mm512_loadu_si512((const void*)(p))
+#define simd_store(p, v) _mm512_storeu_si512((void*)(p), v)
+#define simd_set1(x) _mm512_set1_epi32((int)(x))
+#define simd_xor(a, b) _mm512_xor_si512(a, b)
+#define simd_and(a, b) _mm512_and_si512(a, b)
+#define simd_or(a, b) _mm512_or_si512(a, b)
+#define simd_srl(a, n) _mm512_srlv_epi32(a, simd_set1(n))
+#define simd_sll(a, n) _mm512_sllv_epi32(a, simd_set1(n))
+#define simd_gather(table, index) _mm512_i32gather_epi32(index, (const void*)(table), 4)
+#elif defined(__AVX2__)
+#define SIMD_LANES 8
+typedef __m256i simd_word;
+#define simd_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define simd_store(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define simd_set1(x) _mm256_set1_epi32((int)(x))
+#define simd_xor(a, b) _mm256_xor_si256(a, b)
+#define simd_and(a, b) _mm256_and_si256(a, b)
+#define simd_or(a, b) _mm256_or_si256(a, b)
+#define simd_srl(a, n) _mm256_srlv_epi32(a, simd_set1(n))
+#define simd_sll(a, n) _mm256_sllv_epi32(a, simd_set1(n))
+#define simd_gather(table, index) _mm256_i32gather_epi32((const int*)(table), index, 4)
+#else
+#define SIMD_LANES 0
+#endif
+
+// engine used for whole groups of independent blocks (ECB, CTR, CBC and CFB decryption, batches)
+#define BLOCK_ENGINE (SIMD_LANES ? ENGINE_SIMD : ENGINE_SCALAR)
+
+#if SIMD_LANES
+
+/// <summary>
+/// Lane-wise form of the swap steps used by initial_permutation and final_permutation.
+/// </summary>
+#define SIMD_SWAP_MOVE(a, b, shift, mask) do { \
+    simd_word work = simd_and(simd_xor(simd_srl(a, shift), b), simd_set1(mask)); \
+    b = simd_xor(b, work); \
+    a = simd_xor(a, simd_sll(work, shift)); \
+} while (0)
+
+
+/// <summary>
+/// Rotates every lane to the right.
+/// </summary>
+static inline simd_word simd_rotr(simd_word value, int rotations) {
+    return rotations == 0 ? value : simd_or(simd_srl(value, rotations), simd_sll(value, 32 - rotations));
+}
+
+
+/// <summary>
+/// Encrypts or decrypts SIMD_LANES blocks with the gather kernel, IP and FP included.
+/// </summary>
+/// <param name="left">First 32 bits (big-endian) of every block, replaced by the result</param>
+/// <param name="right">Last 32 bits of every block, replaced by the result</param>
+/// <param name="schedule">Key schedule</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+void des_crypt_simd(uint32_t* left, uint32_t* right, const des_key_schedule* schedule, int decrypt) {
+    simd_word l = simd_load(left);
+    simd_word r = simd_load(right);
+    SIMD_SWAP_MOVE(l, r, 4, 0x0F0F0F0F);
+    SIMD_SWAP_MOVE(l, r, 16, 0x0000FFFF);
+    SIMD_SWAP_MOVE(r, l, 2, 0x33333333);
+    SIMD_SWAP_MOVE(r, l, 8, 0x00FF00FF);
+    SIMD_SWAP_MOVE(l, r, 1, 0x55555555);
+
+    simd_word six_bits = simd_set1(0x3F);
+    for (int i = 0; i < QUARTER_NUM_BITS; i++) {
+        const uint32_t* subkey = schedule->split_subkeys[decrypt ? 15 - i : i];
+        simd_word odd = simd_xor(simd_rotr(r, 3), simd_set1(subkey[0]));
+        simd_word even = simd_xor(simd_rotr(r, 31), simd_set1(subkey[1]));
+        simd_word f = simd_set1(0);
+        for (int b = 0; b < 4; b++) {
+            f = simd_xor(f, simd_gather(SP_table[2 * b], simd_and(simd_srl(odd, 24 - 8 * b), six_bits)));
+            f = simd_xor(f, simd_gather(SP_table[2 * b + 1], simd_and(simd_srl(even, 24 - 8 * b), six_bits)));
+        }
+        simd_word next_left = r;
+        r = simd_xor(l, f);
+        l = next_left;
+    }
+
+    // the preoutput block is R16 L16
+    SIMD_SWAP_MOVE(r, l, 1, 0x55555555);
+    SIMD_SWAP_MOVE(l, r, 8, 0x00FF00FF);
+    SIMD_SWAP_MOVE(l, r, 2, 0x33333333);
+    SIMD_SWAP_MOVE(r, l, 16, 0x0000FFFF);
+    SIMD_SWAP_MOVE(r, l, 4, 0x0F0F0F0F);
+    simd_store(left, r);
+    simd_store(right, l);
+}
+
+#endif
+
+// lanes per des_crypt_lanes call: a full SIMD register, and at least 8 for the scalar rounds
+#define BATCH_LANES (SIMD_LANES > 8 ? SIMD_LANES : 8)
+
+
+/// <summary>
+/// Runs the 16 rounds over up to BATCH_LANES blocks that share one key schedule.
+/// Every round is applied to all lanes before the next one, which keeps the lanes
+/// independent so they can be computed in parallel. Uses des_crypt_simd when it is built in.
+/// </summary>
+/// <param name="blocks">Blocks to be processed in place</param>
+/// <param name="count">Number of used lanes (1 to BATCH_LANES)</param>
+/// <param name="schedule">Key schedule</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+void des_crypt_lanes(uint64_t* blocks, int count, const des_key_schedule* schedule, int decrypt) {
+    uint32_t left[BATCH_LANES], right[BATCH_LANES];
+#if SIMD_LANES
+    for (int first = 0; first < count; first += SIMD_LANES) {
+        int used = count - first < SIMD_LANES ? count - first : SIMD_LANES;
+        for (int j = 0; j < SIMD_LANES; j++) {
+            left[j] = j < used ? (uint32_t)(blocks[first + j] >> HALF_NUM_BITS) : 0;
+            right[j] = j < used ? (uint32_t)blocks[first + j] : 0;
+        }
+        des_crypt_simd(left, right, schedule, decrypt);
+        for (int j = 0; j < used; j++) {
+            blocks[first + j] = ((uint64_t)left[j] << HALF_NUM_BITS) | right[j];
+        }
+    }
+#else
+    for (int j = 0; j < count; j++) {
+        left[j] = (uint32_t)(blocks[j] >> HALF_NUM_BITS);
+        right[j] = (uint32_t)blocks[j];
+        initial_permutation(&left[j], &right[j]);
+    }
+    for (int i = 0; i < QUARTER_NUM_BITS; i++) {
+        const uint32_t* subkey = schedule->split_subkeys[decrypt ? 15 - i : i];
+        for (int j = 0; j < count; j++) {
+            uint32_t next_left = right[j];
+            right[j] = left[j] ^ feistel(right[j], subkey);
+            left[j] = next_left;
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        final_permutation(&right[j], &left[j]);
+        blocks[j] = ((uint64_t)right[j] << HALF_NUM_BITS) | left[j];
+    }
+#endif
+}
+
+
+//// -----------------------modes part-----------------------
+//
+// Aliasing rules of every mode function, here and in the feedback modes part, and of
+// des_encrypt_inplace/des_decrypt_inplace:
+// out may be the same pointer as in (in place), it may start before in (out < in, e.g. to
+// slide the data over a header that has been consumed), or the two ranges may not overlap
+// at all. Output starting after in inside the input range is not supported. This works
+// because blocks are processed front to back and each group of blocks is read completely
+// before its output is stored.
+
+
+/// <summary>
+/// Block cipher modes of operation supported by the engine.
+/// </summary>
+typedef enum cipher_mode {
+    MODE_ECB = 0,
+    MODE_CBC = 1,
+    MODE_CTR = 2,
+    MODE_OFB = 3,
+    MODE_CFB = 4,
+    MODE_CFB8 = 5
+} cipher_mode;
+
+
+// names of the cipher_mode values, as the command line spells them
+static const char* const mode_names[MODE_CFB8 + 1] = { "ecb", "cbc", "ctr", "ofb", "cfb", "cfb8" };
+
+
+/// <summary>
+/// Parses a mode name ("ecb", "cbc", "ctr", "ofb", "cfb", "cfb8").
+/// </summary>
+/// <returns>The cipher_mode value, or -1 for an unknown name</returns>
+int parse_mode(const char* name) {
+    for (int mode = MODE_ECB; mode <= MODE_CFB8; mode++) {
+        if (strcmp(name, mode_names[mode]) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+
+// key and IV of the self-checks and benchmarks
+static const unsigned char fixture_key[BLOCK_BYTES] = { 0x13, 0x34, 0x57, 0x79, 0x9B, 0xBC, 0xDF, 0xF1 };
+static const unsigned char fixture_iv[BLOCK_BYTES] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+
+
+/// <summary>
+/// Sets up the fixture of the self-checks and benchmarks: the schedule of fixture_key and,
+/// if data is not NULL, a byte pattern in data.
+/// </summary>
+void fixture_setup(des_key_schedule* schedule, unsigned char* data, size_t length) {
+    des_key_setup(fixture_key, schedule);
+    for (size_t i = 0; data != NULL && i < length; i++) {
+        data[i] = (unsigned char)(i * 131 + 7);
+    }
+}
+
+
+/// <summary>
+/// Encrypts or decrypts whole blocks in ECB mode.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="in">Input bytes</param>
+/// <param name="out">Output bytes (may be the same buffer as in)</param>
+/// <param name="blocks">Number of 8-byte blocks</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+void des_ecb_crypt(const des_key_schedule* schedule, const unsigned char* in, unsigned char* out, size_t blocks, int decrypt) {
+    DES_PROBE4(mode_entry, MODE_ECB, decrypt, blocks, BLOCK_ENGINE);
+    size_t i = 0;
+#if SIMD_LANES
+    for (; i + SIMD_LANES <= blocks; i += SIMD_LANES) {
+        uint32_t left[SIMD_LANES], right[SIMD_LANES];
+        for (int j = 0; j < SIMD_LANES; j++) {
+            left[j] = load_be32(in + (i + j) * BLOCK_BYTES);
+            right[j] = load_be32(in + (i + j) * BLOCK_BYTES + 4);
+        }
+        des_crypt_simd(left, right, schedule, decrypt);
+        for (int j = 0; j < SIMD_LANES; j++) {
+            store_be32(out + (i + j) * BLOCK_BYTES, left[j]);
+            store_be32(out + (i + j) * BLOCK_BYTES + 4, right[j]);
+        }
+    }
+#endif
+    for (; i < blocks; i++) {
+        des_crypt_bytes(in + i * BLOCK_BYTES, out + i * BLOCK_BYTES, schedule, decrypt);
+    }
+    DES_PROBE4(mode_exit, MODE_ECB, decrypt, blocks, BLOCK_ENGINE);
+}
+
+
+/// <summary>
+/// Encrypts whole blocks in CBC mode.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Plaintext bytes</param>
+/// <param name="out">Ciphertext bytes (may be the same buffer as in)</param>
+/// <param name="blocks">Number of 8-byte blocks</param>
+void des_cbc_encrypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t blocks) {
+    DES_PROBE4(mode_entry, MODE_CBC, 0, blocks, ENGINE_SCALAR);
+    uint64_t chain = load_be64(iv);
+    for (size_t i = 0; i < blocks; i++) {
+        chain = des_crypt_block(load_be64(in + i * BLOCK_BYTES) ^ chain, schedule, 0);
+        store_be64(out + i * BLOCK_BYTES, chain);
+    }
+    DES_PROBE4(mode_exit, MODE_CBC, 0, blocks, ENGINE_SCALAR);
+}
+
+
+/// <summary>
+/// Decrypts whole blocks in CBC mode, BATCH_LANES blocks per des_crypt_lanes call.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Ciphertext bytes</param>
+/// <param name="out">Plaintext bytes (may be the same buffer as in)</param>
+/// <param name="blocks">Number of 8-byte blocks</param>
+void des_cbc_decrypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t blocks) {
+    DES_PROBE4(mode_entry, MODE_CBC, 1, blocks, BLOCK_ENGINE);
+    uint64_t chain = load_be64(iv);
+    uint64_t lanes[BATCH_LANES];
+    uint64_t cipher_blocks[BATCH_LANES];
+    for (size_t i = 0; i < blocks; i += BATCH_LANES) {
+        int used = blocks - i < BATCH_LANES ? (int)(blocks - i) : BATCH_LANES;
+        // the group is read completely before it is written, so in place works
+        for (int j = 0; j < used; j++) {
+            cipher_blocks[j] = load_be64(in + (i + j) * BLOCK_BYTES);
+            lanes[j] = cipher_blocks[j];
+        }
+        des_crypt_lanes(lanes, used, schedule, 1);
+        for (int j = 0; j < used; j++) {
+            store_be64(out + (i + j) * BLOCK_BYTES, lanes[j] ^ chain);
+            chain = cipher_blocks[j];
+        }
+    }
+    DES_PROBE4(mode_exit, MODE_CBC, 1, blocks, BLOCK_ENGINE);
+}
+
+
+/// <summary>
+/// Encrypts or decrypts bytes in CTR mode. The counter block for byte i is counter + i / 8,
+/// so any length is accepted and the operation is its own inverse. The counter blocks are
+/// independent, so BATCH_LANES of them go through one des_crypt_lanes call.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="counter">Counter value of the first block</param>
+/// <param name="in">Input bytes</param>
+/// <param name="out">Output bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes</param>
+void des_ctr_crypt(const des_key_schedule* schedule, uint64_t counter, const unsigned char* in, unsigned char* out, size_t length) {
+    DES_PROBE4(mode_entry, MODE_CTR, 0, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, BLOCK_ENGINE);
+    uint64_t lanes[BATCH_LANES];
+    unsigned char keystream[BATCH_LANES * BLOCK_BYTES];
+    for (size_t pos = 0; pos < length; pos += BATCH_LANES * BLOCK_BYTES) {
+        size_t n = length - pos < BATCH_LANES * BLOCK_BYTES ? length - pos : BATCH_LANES * BLOCK_BYTES;
+        int used = (int)((n + BLOCK_BYTES - 1) / BLOCK_BYTES);
+        for (int j = 0; j < used; j++) {
+            lanes[j] = counter++;
+        }
+        des_crypt_lanes(lanes, used, schedule, 0);
+        for (int j = 0; j < used; j++) {
+            store_be64(keystream + j * BLOCK_BYTES, lanes[j]);
+        }
+        for (size_t k = 0; k < n; k++) {
+            out[pos + k] = in[pos + k] ^ keystream[k];
+        }
+    }
+    DES_PROBE4(mode_exit, MODE_CTR, 0, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, BLOCK_ENGINE);
+}
+
+
+//// -----------------------batch part-----------------------
+//
+// Batched API for many small messages. Requests are grouped by key schedule, and the
+// blocks of a group are packed BATCH_LANES at a time into a lane array that the rounds
+// process side by side. Nothing is allocated: all state lives on the stack.
+
+/// <summary>
+/// One message of a batch. The schedule pointer is the key reference used for grouping.
+/// </summary>
+typedef struct crypt_request {
+    const des_key_schedule* schedule;
+    const unsigned char* iv;
+    const unsigned char* in;
+    unsigned char* out;
+    size_t length;
+} crypt_request;
+
+
+/// <summary>
+/// Returns non-zero if request a has to be placed after request b, ordering by key schedule.
+/// </summary>
+static int request_after(const crypt_request* a, const crypt_request* b) {
+    return (uintptr_t)a->schedule > (uintptr_t)b->schedule;
+}
+
+
+/// <summary>
+/// Moves a request down a heap until the heap property holds again.
+/// </summary>
+static void sift_request_down(crypt_request* requests, size_t root, size_t count) {
+    for (size_t child = root * 2 + 1; child < count; child = root * 2 + 1) {
+        if (child + 1 < count && request_after(&requests[child + 1], &requests[child])) {
+            child++;
+        }
+        if (!request_after(&requests[child], &requests[root])) {
+            return;
+        }
+        crypt_request swap = requests[root];
+        requests[root] = requests[child];
+        requests[child] = swap;
+        root = child;
+    }
+}
+
+
+/// <summary>
+/// Sorts requests by key schedule with an in place heap sort. qsort is avoided because
+/// some C libraries allocate a temporary buffer inside it.
+/// </summary>
+static void sort_requests(crypt_request* requests, size_t count) {
+    for (size_t i = count / 2; i > 0; i--) {
+        sift_request_down(requests, i - 1, count);
+    }
+    for (size_t end = count; end > 1; end--) {
+        crypt_request swap = requests[0];
+        requests[0] = requests[end - 1];
+        requests[end - 1] = swap;
+        sift_request_down(requests, 0, end - 1);
+    }
+}
+
+
+/// <summary>
+/// Processes a run of requests sharing one schedule in a mode without a block chain
+/// (ECB, CTR, CBC decryption). Blocks are taken in order across requests to fill the lanes.
+/// </summary>
+static void batch_flat_group(crypt_request* requests, size_t count, int mode, int decrypt) {
+    const des_key_schedule* schedule = requests[0].schedule;
+    uint64_t lanes[BATCH_LANES], post_xor[BATCH_LANES];
+    const unsigned char* sources[BATCH_LANES];
+    unsigned char* targets[BATCH_LANES];
+    size_t sizes[BATCH_LANES];
+    size_t r = 0, pos = 0;
+    uint64_t chain = 0;
+
+    while (r < count) {
+        int used = 0;
+        while (used < BATCH_LANES && r < count) {
+            const crypt_request* request = &requests[r];
+            if (pos >= request->length) {
+                r++;
+                pos = 0;
+                continue;
+            }
+            size_t n = request->length - pos < BLOCK_BYTES ? request->length - pos : BLOCK_BYTES;
+            if (pos == 0 && request->iv != NULL) {
+                chain = load_be64(request->iv);
+            }
+            sources[used] = request->in + pos;
+            targets[used] = request->out + pos;
+            sizes[used] = n;
+            if (mode == MODE_CTR) {
+                lanes[used] = chain + pos / BLOCK_BYTES;
+            }
+            else {
+                lanes[used] = load_be64(request->in + pos);
+                // the previous ciphertext block is kept here, so in place requests work
+                post_xor[used] = chain;
+                chain = lanes[used];
+            }
+            used++;
+            pos += BLOCK_BYTES;
+        }
+        if (used == 0) {
+            break;
+        }
+
+        des_crypt_lanes(lanes, used, schedule, mode == MODE_CTR ? 0 : decrypt);
+        for (int j = 0; j < used; j++) {
+            if (mode == MODE_CTR) {
+                unsigned char keystream[BLOCK_BYTES];
+                store_be64(keystream, lanes[j]);
+                for (size_t k = 0; k < sizes[j]; k++) {
+                    targets[j][k] = sources[j][k] ^ keystream[k];
+                }
+            }
+            else {
+                store_be64(targets[j], mode == MODE_CBC ? lanes[j] ^ post_xor[j] : lanes[j]);
+            }
+        }
+    }
+}
+
+
+/// <summary>
+/// CBC-encrypts a run of requests sharing one schedule. Each lane follows the chain of
+/// one request, and a lane is refilled with the next request as soon as its request ends.
+/// </summary>
+static void batch_cbc_encrypt_group(crypt_request* requests, size_t count) {
+    const des_key_schedule* schedule = requests[0].schedule;
+    uint64_t lanes[BATCH_LANES], chains[BATCH_LANES];
+    const crypt_request* active[BATCH_LANES];
+    size_t positions[BATCH_LANES];
+    size_t next = 0;
+    int used = 0;
+
+    for (;;) {
+        while (used < BATCH_LANES && next < count) {
+            if (requests[next].length > 0) {
+                active[used] = &requests[next];
+                positions[used] = 0;
+                chains[used] = load_be64(requests[next].iv);
+                used++;
+            }
+            next++;
+        }
+        if (used == 0) {
+            return;
+        }
+
+        for (int j = 0; j < used; j++) {
+            lanes[j] = load_be64(active[j]->in + positions[j]) ^ chains[j];
+        }
+        des_crypt_lanes(lanes, used, schedule, 0);
+        for (int j = 0; j < used; j++) {
+            chains[j] = lanes[j];
+            store_be64(active[j]->out + positions[j], lanes[j]);
+            positions[j] += BLOCK_BYTES;
+        }
+
+        for (int j = 0; j < used;) {
+            if (positions[j] < active[j]->length) {
+                j++;
+                continue;
+            }
+            used--;
+            active[j] = active[used];
+            positions[j] = positions[used];
+            chains[j] = chains[used];
+        }
+    }
+}
+
+
+/// <summary>
+/// Encrypts or decrypts many small messages in one call, without allocating.
+/// </summary>
+/// <param name="requests">Request descriptors; they are reordered in place to group them by key</param>
+/// <param name="count">Number of requests</param>
+/// <param name="mode">MODE_ECB, MODE_CBC or MODE_CTR</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+/// <returns>0 on success, -1 if a request is invalid (nothing is processed then)</returns>
+/// <remarks>Input and output of a request may be the same buffer. The iv of a request is
+///          required for CBC and CTR and ignored for ECB.</remarks>
+int des_crypt_batch(crypt_request* requests, size_t count, int mode, int decrypt) {
+    for (size_t i = 0; i < count; i++) {
+        if (mode < MODE_ECB || mode > MODE_CTR || (mode != MODE_CTR && requests[i].length % BLOCK_BYTES != 0)
+            || (mode != MODE_ECB && requests[i].iv == NULL)) {
+            fprintf(stderr, "Invalid batch request %zu.\n", i);
+            return -1;
+        }
+    }
+
+    DES_PROBE3(batch_start, count, mode, BLOCK_ENGINE);
+    sort_requests(requests, count);
+    for (size_t first = 0; first < count;) {
+        size_t last = first + 1;
+        while (last < count && requests[last].schedule == requests[first].schedule) {
+            last++;
+        }
+        if (mode == MODE_CBC && !decrypt) {
+            batch_cbc_encrypt_group(requests + first, last - first);
+        }
+        else {
+            batch_flat_group(requests + first, last - first, mode, decrypt);
+        }
+        first = last;
+    }
+    DES_PROBE3(batch_end, count, mode, BLOCK_ENGINE);
+    return 0;
+}
+
+
+//// -----------------------feedback modes part-----------------------
+//
+// OFB, CFB-64 and CFB-8 (the 8-bit feedback variant used by some legacy protocols). None
+// of them pads, any length is accepted. Encryption is inherently serial in all three, as
+// is OFB in both directions. CFB decryption only needs ciphertext that is already known,
+// so it runs BATCH_LANES cipher calls side by side through des_crypt_lanes, like the
+// batched CBC decryption, and the scheduler splits it into ranges between threads.
+
+
+/// <summary>
+/// Encrypts or decrypts bytes in OFB mode. The operation is its own inverse.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Input bytes</param>
+/// <param name="out">Output bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes</param>
+void des_ofb_crypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length) {
+    DES_PROBE4(mode_entry, MODE_OFB, 0, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, ENGINE_SCALAR);
+    uint64_t feedback = load_be64(iv);
+    unsigned char keystream[BLOCK_BYTES];
+    for (size_t pos = 0; pos < length; pos += BLOCK_BYTES) {
+        feedback = des_crypt_block(feedback, schedule, 0);
+        store_be64(keystream, feedback);
+        size_t n = length - pos < BLOCK_BYTES ? length - pos : BLOCK_BYTES;
+        for (size_t j = 0; j < n; j++) {
+            out[pos + j] = in[pos + j] ^ keystream[j];
+        }
+    }
+    DES_PROBE4(mode_exit, MODE_OFB, 0, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, ENGINE_SCALAR);
+}
+
+
+/// <summary>
+/// Encrypts bytes in CFB-64 mode. A final partial block uses the leading keystream bytes.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Plaintext bytes</param>
+/// <param name="out">Ciphertext bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes</param>
+void des_cfb_encrypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length) {
+    DES_PROBE4(mode_entry, MODE_CFB, 0, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, ENGINE_SCALAR);
+    uint64_t chain = load_be64(iv);
+    unsigned char keystream[BLOCK_BYTES];
+    for (size_t pos = 0; pos < length; pos += BLOCK_BYTES) {
+        store_be64(keystream, des_crypt_block(chain, schedule, 0));
+        size_t n = length - pos < BLOCK_BYTES ? length - pos : BLOCK_BYTES;
+        for (size_t j = 0; j < n; j++) {
+            out[pos + j] = in[pos + j] ^ keystream[j];
+        }
+        if (n == BLOCK_BYTES) {
+            chain = load_be64(out + pos);
+        }
+    }
+    DES_PROBE4(mode_exit, MODE_CFB, 0, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, ENGINE_SCALAR);
+}
+
+
+/// <summary>
+/// Decrypts bytes in CFB-64 mode, BATCH_LANES blocks per des_crypt_lanes call.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Ciphertext bytes</param>
+/// <param name="out">Plaintext bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes</param>
+void des_cfb_decrypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length) {
+    DES_PROBE4(mode_entry, MODE_CFB, 1, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, BLOCK_ENGINE);
+    uint64_t chain = load_be64(iv);
+    uint64_t lanes[BATCH_LANES];
+    unsigned char keystream[BATCH_LANES * BLOCK_BYTES];
+    for (size_t pos = 0; pos < length; pos += BATCH_LANES * BLOCK_BYTES) {
+        size_t n = length - pos < BATCH_LANES * BLOCK_BYTES ? length - pos : BATCH_LANES * BLOCK_BYTES;
+        int used = (int)((n + BLOCK_BYTES - 1) / BLOCK_BYTES);
+        // every cipher input is read before the group is written, so in place works
+        lanes[0] = chain;
+        for (int j = 1; j < used; j++) {
+            lanes[j] = load_be64(in + pos + (j - 1) * BLOCK_BYTES);
+        }
+        if (n == BATCH_LANES * BLOCK_BYTES) {
+            chain = load_be64(in + pos + n - BLOCK_BYTES);
+        }
+        des_crypt_lanes(lanes, used, schedule, 0);
+        for (int j = 0; j < used; j++) {
+            store_be64(keystream + j * BLOCK_BYTES, lanes[j]);
+        }
+        for (size_t k = 0; k < n; k++) {
+            out[pos + k] = in[pos + k] ^ keystream[k];
+        }
+    }
+    DES_PROBE4(mode_exit, MODE_CFB, 1, (length + BLOCK_BYTES - 1) / BLOCK_BYTES, BLOCK_ENGINE);
+}
+
+
+/// <summary>
+/// Encrypts bytes in CFB-8 mode: one cipher call per byte, the shift register takes each
+/// ciphertext byte.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Plaintext bytes</param>
+/// <param name="out">Ciphertext bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes</param>
+void des_cfb8_encrypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length) {
+    DES_PROBE4(mode_entry, MODE_CFB8, 0, length, ENGINE_SCALAR);
+    uint64_t shift = load_be64(iv);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char cipher_byte = in[i] ^ (unsigned char)(des_crypt_block(shift, schedule, 0) >> 56);
+        out[i] = cipher_byte;
+        shift = (shift << 8) | cipher_byte;
+    }
+    DES_PROBE4(mode_exit, MODE_CFB8, 0, length, ENGINE_SCALAR);
+}
+
+
+/// <summary>
+/// Decrypts bytes in CFB-8 mode. The shift register of every byte is known from the
+/// ciphertext, so BATCH_LANES bytes are decrypted per des_crypt_lanes call.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <param name="in">Ciphertext bytes</param>
+/// <param name="out">Plaintext bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes</param>
+void des_cfb8_decrypt(const des_key_schedule* schedule, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length) {
+    DES_PROBE4(mode_entry, MODE_CFB8, 1, length, BLOCK_ENGINE);
+    uint64_t shift = load_be64(iv);
+    uint64_t lanes[BATCH_LANES];
+    for (size_t pos = 0; pos < length; pos += BATCH_LANES) {
+        int used = length - pos < BATCH_LANES ? (int)(length - pos) : BATCH_LANES;
+        for (int j = 0; j < used; j++) {
+            lanes[j] = shift;
+            shift = (shift << 8) | in[pos + j];
+        }
+        des_crypt_lanes(lanes, used, schedule, 0);
+        for (int j = 0; j < used; j++) {
+            out[pos + j] = in[pos + j] ^ (unsigned char)(lanes[j] >> 56);
+        }
+    }
+    DES_PROBE4(mode_exit, MODE_CFB8, 1, length, BLOCK_ENGINE);
+}
+
+
+/// <summary>
+/// Runs one of the unpadded modes (CTR, OFB, CFB, CFB-8) over a byte range.
+/// </summary>
+/// <param name="iv">8-byte IV, or initial counter for CTR</param>
+static void des_stream_mode_crypt(const des_key_schedule* schedule, int mode, int decrypt, const unsigned char* iv,
+    const unsigned char* in, unsigned char* out, size_t length) {
+    if (mode == MODE_CTR)
+        des_ctr_crypt(schedule, load_be64(iv), in, out, length);
+    else if (mode == MODE_OFB)
+        des_ofb_crypt(schedule, iv, in, out, length);
+    else if (mode == MODE_CFB && decrypt)
+        des_cfb_decrypt(schedule, iv, in, out, length);
+    else if (mode == MODE_CFB)
+        des_cfb_encrypt(schedule, iv, in, out, length);
+    else if (decrypt)
+        des_cfb8_decrypt(schedule, iv, in, out, length);
+    else
+        des_cfb8_encrypt(schedule, iv, in, out, length);
+}
+
+
+/// <summary>
+/// Encrypts a caller buffer in place, so no second copy of the data is needed. ECB and CBC
+/// append PKCS#5 padding inside the buffer, which needs room for up to 8 more bytes; the
+/// other modes keep the length.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="mode">One of the cipher_mode values</param>
+/// <param name="iv">8-byte IV, or initial counter for CTR; ignored for ECB</param>
+/// <param name="buffer">Plaintext on entry, ciphertext on return</param>
+/// <param name="length">Plaintext length on entry, ciphertext length on return</param>
+/// <param name="capacity">Size of the buffer in bytes</param>
+/// <returns>0 on success, -1 on invalid parameters or a buffer too small for the padding</returns>
+int des_encrypt_inplace(const des_key_schedule* schedule, int mode, const unsigned char* iv, unsigned char* buffer,
+    size_t* length, size_t capacity) {
+    if (mode < MODE_ECB || mode > MODE_CFB8 || (mode != MODE_ECB && iv == NULL)) {
+        return -1;
+    }
+    if (mode > MODE_CBC) {
+        des_stream_mode_crypt(schedule, mode, 0, iv, buffer, buffer, *length);
+        return 0;
+    }
+    unsigned char pad = (unsigned char)(BLOCK_BYTES - *length % BLOCK_BYTES);
+    if (*length + pad > capacity) {
+        return -1;
+    }
+    memset(buffer + *length, pad, pad);
+    *length += pad;
+    if (mode == MODE_ECB) {
+        des_ecb_crypt(schedule, buffer, buffer, *length / BLOCK_BYTES, 0);
+    }
+    else {
+        des_cbc_encrypt(schedule, iv, buffer, buffer, *length / BLOCK_BYTES);
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Decrypts a caller buffer in place and strips the PKCS#5 padding of ECB and CBC.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="mode">One of the cipher_mode values</param>
+/// <param name="iv">8-byte IV, or initial counter for CTR; ignored for ECB</param>
+/// <param name="buffer">Ciphertext on entry, plaintext on return</param>
+/// <param name="length">Ciphertext length on entry, plaintext length on return</param>
+/// <returns>0 on success, -1 on invalid parameters or invalid padding (the length is left unchanged then)</returns>
+int des_decrypt_inplace(const des_key_schedule* schedule, int mode, const unsigned char* iv, unsigned char* buffer,
+    size_t* length) {
+    if (mode < MODE_ECB || mode > MODE_CFB8 || (mode != MODE_ECB && iv == NULL)
+        || (mode <= MODE_CBC && (*length == 0 || *length % BLOCK_BYTES != 0))) {
+        return -1;
+    }
+    if (mode > MODE_CBC) {
+        des_stream_mode_crypt(schedule, mode, 1, iv, buffer, buffer, *length);
+        return 0;
+    }
+    if (mode == MODE_ECB) {
+        des_ecb_crypt(schedule, buffer, buffer, *length / BLOCK_BYTES, 1);
+    }
+    else {
+        des_cbc_decrypt(schedule, iv, buffer, buffer, *length / BLOCK_BYTES);
+    }
+    unsigned char pad = buffer[*length - 1];
+    if (pad == 0 || pad > BLOCK_BYTES) {
+        return -1;
+    }
+    for (size_t i = *length - pad; i < *length; i++) {
+        if (buffer[i] != pad) {
+            return -1;
+        }
+    }
+    *length -= pad;
+    return 0;
+}
+
+
+//// -----------------------threading part-----------------------
+
+
+/// <summary>
+/// Work item callback for parallel_for.
+/// </summary>
+typedef void (*parallel_task)(void* context, int index);
+
+
+/// <summary>
+/// Runs task(context, i) for every i in [0, count) on up to the given number of threads.
+/// Indices are handed out dynamically, so uneven items are balanced between threads.
+/// </summary>
+/// <param name="count">Number of work items</param>
+/// <param name="threads">Number of threads, 0 for one per hardware thread</param>
+/// <param name="task">Callback run for each item</param>
+/// <param name="context">Pointer passed to every callback</param>
+void parallel_for(int count, int threads, parallel_task task, void* context) {
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    if (threads > count) {
+        threads = count;
+    }
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++) {
+            task(context, i);
+        }
+        return;
+    }
+
+    DES_PROBE2(pool_dispatch, count, threads);
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            task(context, i);
+        }
+    };
+    alloc_stats* scope = alloc_scope_current();
+    std::thread* pool = new std::thread[threads - 1];
+    for (int t = 0; t < threads - 1; t++) {
+        pool[t] = std::thread([&]() {
+            alloc_scope_attach(scope);
+            worker();
+        });
+    }
+    worker();
+    for (int t = 0; t < threads - 1; t++) {
+        pool[t].join();
+    }
+    delete[] pool;
+}
+
+
+//// -----------------------keystream prefetch part-----------------------
+//
+// The OFB keystream does not depend on the data, so a background thread can compute it
+// ahead of the consumer. The producer fills a single-producer single-consumer ring of
+// keystream bytes; each side only writes its own counter and reads the other's, so no
+// lock is taken while both sides make progress. A side that finds the ring full (or
+// empty) sleeps on a condition variable after raising its waiting flag and naming the
+// count it waits for, OFB_WAKE_BLOCKS ahead; the other side takes the lock to wake it
+// only once that count is reached. An idle prefetcher costs no CPU, and a busy one
+// does not bounce between the threads for every few blocks. The consumer's data path
+// is a plain XOR.
+
+#define OFB_RING_BLOCKS 8192
+#define OFB_PRODUCE_BLOCKS 64
+#define OFB_WAKE_BLOCKS (OFB_RING_BLOCKS / 4)
+
+
+/// <summary>
+/// OFB keystream generator running on its own thread.
+/// </summary>
+typedef struct ofb_prefetcher {
+    des_key_schedule schedule;
+    uint64_t feedback;                  // producer only
+    uint64_t position;                  // consumer only, keystream bytes used so far
+    std::atomic<uint64_t> produced;     // blocks written to the ring
+    std::atomic<uint64_t> consumed;     // blocks the consumer is done with
+    std::atomic<int> stop;
+    std::atomic<int> producer_waiting;
+    std::atomic<int> consumer_waiting;
+    std::atomic<uint64_t> producer_wake; // consumed count the sleeping producer waits for
+    std::atomic<uint64_t> consumer_wake; // produced count the sleeping consumer waits for
+    std::mutex lock;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::thread thread;
+    unsigned char ring[OFB_RING_BLOCKS * BLOCK_BYTES];
+} ofb_prefetcher;
+
+
+/// <summary>
+/// XORs two byte arrays, 32 bytes at a time where AVX2 is built in.
+/// </summary>
+static void xor_bytes(const unsigned char* a, const unsigned char* b, unsigned char* out, size_t length) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_xor_si256(x, y));
+    }
+#endif
+    for (; i < length; i++) {
+        out[i] = a[i] ^ b[i];
+    }
+}
+
+
+/// <summary>
+/// Producer thread: keeps the ring full until the prefetcher is stopped.
+/// </summary>
+static void ofb_producer(ofb_prefetcher* prefetcher) {
+    uint64_t produced = 0;
+    while (!prefetcher->stop.load(std::memory_order_relaxed)) {
+        uint64_t space = OFB_RING_BLOCKS - (produced - prefetcher->consumed.load(std::memory_order_acquire));
+        if (space == 0) {
+            // the flag is raised before the last look at consumed, see ofb_prefetch_crypt
+            std::unique_lock<std::mutex> guard(prefetcher->lock);
+            prefetcher->producer_wake = produced - OFB_RING_BLOCKS + OFB_WAKE_BLOCKS;
+            prefetcher->producer_waiting = 1;
+            prefetcher->not_full.wait(guard, [&] {
+                return prefetcher->stop || prefetcher->consumed >= prefetcher->producer_wake;
+            });
+            prefetcher->producer_waiting = 0;
+            continue;
+        }
+        uint64_t count = space < OFB_PRODUCE_BLOCKS ? space : OFB_PRODUCE_BLOCKS;
+        for (uint64_t i = 0; i < count; i++) {
+            prefetcher->feedback = des_crypt_block(prefetcher->feedback, &prefetcher->schedule, 0);
+            store_be64(prefetcher->ring + (produced + i) % OFB_RING_BLOCKS * BLOCK_BYTES, prefetcher->feedback);
+        }
+        produced += count;
+        prefetcher->produced = produced;
+        if (prefetcher->consumer_waiting && produced >= prefetcher->consumer_wake) {
+            std::lock_guard<std::mutex> guard(prefetcher->lock);
+            prefetcher->not_empty.notify_one();
+        }
+    }
+}
+
+
+/// <summary>
+/// Starts generating the OFB keystream of a key and IV in the background.
+/// </summary>
+/// <param name="schedule">Key schedule, copied</param>
+/// <param name="iv">8-byte initialization vector</param>
+/// <returns>The prefetcher, or NULL on failure</returns>
+ofb_prefetcher* ofb_prefetcher_create(const des_key_schedule* schedule, const unsigned char* iv) {
+    ofb_prefetcher* prefetcher = new ofb_prefetcher();
+    prefetcher->schedule = *schedule;
+    prefetcher->feedback = load_be64(iv);
+    prefetcher->position = 0;
+    prefetcher->produced = 0;
+    prefetcher->consumed = 0;
+    prefetcher->stop = 0;
+    prefetcher->producer_waiting = 0;
+    prefetcher->consumer_waiting = 0;
+    prefetcher->producer_wake = 0;
+    prefetcher->consumer_wake = 0;
+    prefetcher->thread = std::thread(ofb_producer, prefetcher);
+    return prefetcher;
+}
+
+
+/// <summary>
+/// Encrypts or decrypts the next bytes of the OFB stream with prefetched keystream. Sleeps
+/// only if the producer has fallen behind. Calls must come from one thread at a time.
+/// </summary>
+/// <param name="prefetcher">The prefetcher</param>
+/// <param name="in">Input bytes</param>
+/// <param name="out">Output bytes (may be the same buffer as in)</param>
+/// <param name="length">Number of bytes, any length; the stream continues at the next byte</param>
+void ofb_prefetch_crypt(ofb_prefetcher* prefetcher, const unsigned char* in, unsigned char* out, size_t length) {
+    const uint64_t ring_bytes = OFB_RING_BLOCKS * BLOCK_BYTES;
+    size_t done = 0;
+    while (done < length) {
+        uint64_t available = prefetcher->produced.load(std::memory_order_acquire) * BLOCK_BYTES - prefetcher->position;
+        if (available == 0) {
+            uint64_t need = length - done < OFB_WAKE_BLOCKS * BLOCK_BYTES ? length - done : OFB_WAKE_BLOCKS * BLOCK_BYTES;
+            // the waiting flags and counters are sequentially consistent: either this side
+            // sees the new count, or the producer sees the flag and wakes it under the lock
+            std::unique_lock<std::mutex> guard(prefetcher->lock);
+            prefetcher->consumer_wake = (prefetcher->position + need + BLOCK_BYTES - 1) / BLOCK_BYTES;
+            prefetcher->consumer_waiting = 1;
+            prefetcher->not_empty.wait(guard, [&] { return prefetcher->produced >= prefetcher->consumer_wake; });
+            prefetcher->consumer_waiting = 0;
+            continue;
+        }
+        uint64_t offset = prefetcher->position % ring_bytes;
+        size_t n = length - done;
+        if (n > available) {
+            n = (size_t)available;
+        }
+        if (n > ring_bytes - offset) {
+            n = (size_t)(ring_bytes - offset);
+        }
+        xor_bytes(in + done, prefetcher->ring + offset, out + done, n);
+        done += n;
+        prefetcher->position += n;
+        prefetcher->consumed = prefetcher->position / BLOCK_BYTES;
+        if (prefetcher->producer_waiting && prefetcher->consumed >= prefetcher->producer_wake) {
+            std::lock_guard<std::mutex> guard(prefetcher->lock);
+            prefetcher->not_full.notify_one();
+        }
+    }
+}
+
+
+/// <summary>
+/// Stops the producer thread and frees the prefetcher.
+/// </summary>
+void ofb_prefetcher_destroy(ofb_prefetcher* prefetcher) {
+    if (prefetcher == NULL) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(prefetcher->lock);
+        prefetcher->stop = 1;
+    }
+    prefetcher->not_full.notify_one();
+    prefetcher->thread.join();
+    delete prefetcher;
+}
+
+
+//// -----------------------bulk key setup part-----------------------
+
+#define KEY_SETUP_CHUNK 4096
+
+
+/// <summary>
+/// Arguments shared by the bulk key setup tasks.
+/// </summary>
+typedef struct key_setup_job {
+    const unsigned char* keys;
+    size_t count;
+    des_key_schedule* schedules;
+} key_setup_job;
+
+
+/// <summary>
+/// parallel_for task building the schedules of one chunk of keys, KEY_LANES at a time.
+/// </summary>
+static void key_setup_task(void* context, int index) {
+    key_setup_job* job = (key_setup_job*)context;
+    size_t first = (size_t)index * KEY_SETUP_CHUNK;
+    size_t last = first + KEY_SETUP_CHUNK < job->count ? first + KEY_SETUP_CHUNK : job->count;
+    for (size_t i = first; i < last; i += KEY_LANES) {
+        int lanes = last - i < KEY_LANES ? (int)(last - i) : KEY_LANES;
+        key_setup_lanes(job->keys + i * BLOCK_BYTES, lanes, job->schedules + i);
+    }
+}
+
+
+/// <summary>
+/// Builds many key schedules at once, for rekeying or loading a whole key set.
+/// </summary>
+/// <param name="keys">count consecutive 8-byte keys</param>
+/// <param name="count">Number of keys</param>
+/// <param name="schedules">Caller-provided contiguous array receiving count schedules, in key order</param>
+/// <param name="threads">Number of threads, 0 for one per hardware thread</param>
+/// <remarks>Nothing is allocated besides the worker threads.</remarks>
+void des_key_setup_bulk(const unsigned char* keys, size_t count, des_key_schedule* schedules, int threads) {
+    init_engine_tables();
+    key_setup_job job = { keys, count, schedules };
+    DES_PROBE2(key_setup, count, threads);
+    parallel_for((int)((count + KEY_SETUP_CHUNK - 1) / KEY_SETUP_CHUNK), threads, key_setup_task, &job);
+}
+
+
+//// -----------------------reduced rounds part-----------------------
+//
+// High-volume evaluation of DES reduced to 1..16 rounds for cryptanalysis experiments.
+// Blocks are processed BATCH_LANES at a time with every round applied to all lanes before
+// the next, and spread over threads with parallel_for. An optional histogram records the
+// 6-bit input and 4-bit output of every S-Box in every round; each thread counts into its
+// own copy and the copies are added up at the end, so counting needs no atomics. With
+// ROUNDS_NO_PERMUTATIONS the initial and final permutations are left out.
+
+#define ROUNDS_NO_PERMUTATIONS 1
+#define ROUNDS_STATS_CHUNK (1 << 20)
+
+
+/// <summary>
+/// S-Box statistics per round. For des_rounds_evaluate an entry counts S-Box input or
+/// output values; for des_rounds_evaluate_pairs it counts input and output differences
+/// of the two members of each pair.
+/// </summary>
+typedef struct sbox_histogram {
+    uint64_t inputs[QUARTER_NUM_BITS][8][64];
+    uint64_t outputs[QUARTER_NUM_BITS][8][16];
+} sbox_histogram;
+
+
+/// <summary>
+/// Shared state of one evaluation, split into one range of blocks per thread.
+/// </summary>
+typedef struct rounds_job {
+    const des_key_schedule* schedule;
+    int rounds;
+    int flags;
+    const uint64_t* in;
+    uint64_t* out;
+    size_t count;
+    int pairs;
+    uint64_t difference;
+    int tasks;
+    sbox_histogram* histograms;
+} rounds_job;
+
+
+/// <summary>
+/// 4-bit output of S-Box s for a 6-bit input.
+/// </summary>
+static inline uint32_t sbox_output(int s, uint32_t input) {
+    return (uint32_t)S_Box[s][((input >> 4) & 2) | (input & 1)][(input >> 1) & 0xF];
+}
+
+
+/// <summary>
+/// Counts the S-Box input and output differences of one round for a group of lanes, where
+/// lanes 2j and 2j + 1 form a pair.
+/// </summary>
+static void count_sbox_differences(sbox_histogram* histogram, int round, const uint32_t* subkey, const uint32_t* right, int count) {
+    for (int j = 0; j < count; j += 2) {
+        for (int s = 0; s < 8; s++) {
+            int rotation = s & 1 ? 31 : 3;
+            int shift = 24 - 8 * (s >> 1);
+            uint32_t input = ((rotr32(right[j], rotation) ^ subkey[s & 1]) >> shift) & 0x3F;
+            uint32_t other = ((rotr32(right[j + 1], rotation) ^ subkey[s & 1]) >> shift) & 0x3F;
+            histogram->inputs[round][s][input ^ other]++;
+            histogram->outputs[round][s][sbox_output(s, input) ^ sbox_output(s, other)]++;
+        }
+    }
+}
+
+
+/// <summary>
+/// Runs the first rounds of DES over up to BATCH_LANES packed blocks in place. The result
+/// is the preoutput R(rounds) L(rounds), through the Final Permutation unless flags say
+/// otherwise, so 16 rounds give the same result as des_crypt_block.
+/// </summary>
+static void rounds_lanes(const rounds_job* job, uint64_t* blocks, int count, sbox_histogram* histogram) {
+    uint32_t left[BATCH_LANES], right[BATCH_LANES];
+    for (int j = 0; j < count; j++) {
+        left[j] = (uint32_t)(blocks[j] >> HALF_NUM_BITS);
+        right[j] = (uint32_t)blocks[j];
+        if (!(job->flags & ROUNDS_NO_PERMUTATIONS)) {
+            initial_permutation(&left[j], &right[j]);
+        }
+    }
+    for (int i = 0; i < job->rounds; i++) {
+        const uint32_t* subkey = job->schedule->split_subkeys[i];
+        if (histogram != NULL && !job->pairs) {
+            // counting fused into the round, so every S-Box index is computed once; the
+            // output counts follow from the input counts when the histograms are merged
+            uint64_t (*inputs)[64] = histogram->inputs[i];
+            for (int j = 0; j < count; j++) {
+                uint32_t odd = rotr32(right[j], 3) ^ subkey[0];
+                uint32_t even = rotr32(right[j], 31) ^ subkey[1];
+                uint32_t output = 0;
+                for (int b = 0; b < 4; b++) {
+                    uint32_t odd_index = (odd >> (24 - 8 * b)) & 0x3F;
+                    uint32_t even_index = (even >> (24 - 8 * b)) & 0x3F;
+                    inputs[2 * b][odd_index]++;
+                    inputs[2 * b + 1][even_index]++;
+                    output ^= SP_table[2 * b][odd_index] ^ SP_table[2 * b + 1][even_index];
+                }
+                uint32_t next_left = right[j];
+                right[j] = left[j] ^ output;
+                left[j] = next_left;
+            }
+            continue;
+        }
+        if (histogram != NULL) {
+            count_sbox_differences(histogram, i, subkey, right, count);
+        }
+        for (int j = 0; j < count; j++) {
+            uint32_t next_left = right[j];
+            right[j] = left[j] ^ feistel(right[j], subkey);
+            left[j] = next_left;
+        }
+    }
+    for (int j = 0; j < count; j++) {
+        if (!(job->flags & ROUNDS_NO_PERMUTATIONS)) {
+            final_permutation(&right[j], &left[j]);
+        }
+        blocks[j] = ((uint64_t)right[j] << HALF_NUM_BITS) | left[j];
+    }
+}
+
+
+/// <summary>
+/// parallel_for task: evaluates the range of blocks (or pairs) that belongs to one thread.
+/// </summary>
+static void rounds_task(void* context, int index) {
+    rounds_job* job = (rounds_job*)context;
+    size_t first = job->count * index / job->tasks;
+    size_t last = job->count * (index + 1) / job->tasks;
+    sbox_histogram* histogram = job->histograms != NULL ? &job->histograms[index] : NULL;
+    int per_group = job->pairs ? BATCH_LANES / 2 : BATCH_LANES;
+    uint64_t blocks[BATCH_LANES];
+    for (size_t i = first; i < last; i += per_group) {
+        int used = last - i < (size_t)per_group ? (int)(last - i) : per_group;
+        for (int j = 0; j < used; j++) {
+            if (job->pairs) {
+                blocks[2 * j] = job->in[i + j];
+                blocks[2 * j + 1] = job->in[i + j] ^ job->difference;
+            }
+            else {
+                blocks[j] = job->in[i + j];
+            }
+        }
+        rounds_lanes(job, blocks, job->pairs ? 2 * used : used, histogram);
+        for (int j = 0; j < used; j++) {
+            job->out[i + j] = job->pairs ? blocks[2 * j] ^ blocks[2 * j + 1] : blocks[j];
+        }
+    }
+}
+
+
+/// <summary>
+/// Runs an evaluation job on the given number of threads and adds the per-thread
+/// histograms to the caller's one.
+/// </summary>
+/// <returns>0 on success, -1 on invalid parameters or allocation failure</returns>
+static int rounds_run(rounds_job* job, int threads, sbox_histogram* histogram) {
+    if (job->rounds < 1 || job->rounds > QUARTER_NUM_BITS) {
+        fprintf(stderr, "The round count must be between 1 and %d.\n", QUARTER_NUM_BITS);
+        return -1;
+    }
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    size_t groups = (job->count + BATCH_LANES - 1) / BATCH_LANES;
+    job->tasks = threads < 1 ? 1 : (groups < (size_t)threads ? (int)(groups > 0 ? groups : 1) : threads);
+    job->histograms = NULL;
+    if (histogram != NULL) {
+        job->histograms = (sbox_histogram*)des_calloc(job->tasks, sizeof(sbox_histogram));
+        if (job->histograms == NULL) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            return -1;
+        }
+    }
+
+    parallel_for(job->tasks, job->tasks, rounds_task, job);
+
+    if (histogram != NULL) {
+        for (int t = 0; t < job->tasks; t++) {
+            for (int i = 0; i < job->rounds; i++) {
+                for (int s = 0; s < 8; s++) {
+                    for (int v = 0; v < 64; v++) {
+                        histogram->inputs[i][s][v] += job->histograms[t].inputs[i][s][v];
+                        if (!job->pairs) {
+                            histogram->outputs[i][s][sbox_output(s, v)] += job->histograms[t].inputs[i][s][v];
+                        }
+                    }
+                    for (int v = 0; job->pairs && v < 16; v++) {
+                        histogram->outputs[i][s][v] += job->histograms[t].outputs[i][s][v];
+                    }
+                }
+            }
+        }
+        des_free(job->histograms);
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Encrypts packed blocks through the first rounds of DES.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="rounds">Number of rounds, 1 to 16</param>
+/// <param name="flags">0 or ROUNDS_NO_PERMUTATIONS</param>
+/// <param name="in">Input blocks, first byte in the most significant bits</param>
+/// <param name="out">Output blocks (may be the same array as in)</param>
+/// <param name="count">Number of blocks</param>
+/// <param name="threads">Number of threads, 0 for one per hardware thread</param>
+/// <param name="histogram">S-Box value counts are added here, or NULL to skip counting</param>
+/// <returns>0 on success, -1 on invalid parameters</returns>
+int des_rounds_evaluate(const des_key_schedule* schedule, int rounds, int flags, const uint64_t* in, uint64_t* out,
+    size_t count, int threads, sbox_histogram* histogram) {
+    rounds_job job = { schedule, rounds, flags, in, out, count, 0, 0, 0, NULL };
+    return rounds_run(&job, threads, histogram);
+}
+
+
+/// <summary>
+/// Encrypts every input block and its partner (block ^ difference) through the first
+/// rounds of DES and returns the output differences, for differential experiments.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="rounds">Number of rounds, 1 to 16</param>
+/// <param name="flags">0 or ROUNDS_NO_PERMUTATIONS</param>
+/// <param name="in">First members of the pairs</param>
+/// <param name="difference">Input difference of every pair</param>
+/// <param name="out_differences">Receives the output difference of every pair (may be the same array as in)</param>
+/// <param name="count">Number of pairs</param>
+/// <param name="threads">Number of threads, 0 for one per hardware thread</param>
+/// <param name="histogram">S-Box input and output difference counts are added here, or NULL</param>
+/// <returns>0 on success, -1 on invalid parameters</returns>
+int des_rounds_evaluate_pairs(const des_key_schedule* schedule, int rounds, int flags, const uint64_t* in, uint64_t difference,
+    uint64_t* out_differences, size_t count, int threads, sbox_histogram* histogram) {
+    rounds_job job = { schedule, rounds, flags, in, out_differences, count, 1, difference, 0, NULL };
+    return rounds_run(&job, threads, histogram);
+}
+
+
+/// <summary>
+/// Differential experiment from the command line: encrypts pseudo-random pairs with the
+/// given input difference through the first rounds and prints, for every round and
+/// S-Box, the share of pairs in which the S-Box is active (non-zero input difference).
+/// </summary>
+/// <param name="key">8-byte key</param>
+/// <param name="rounds">Number of rounds, 1 to 16</param>
+/// <param name="difference">Input difference of the pairs</param>
+/// <param name="pairs">Number of pairs</param>
+/// <param name="threads">Number of threads, 0 for one per hardware thread</param>
+/// <returns>0 on success, 1 on failure</returns>
+int run_rounds_stats(const unsigned char* key, int rounds, uint64_t difference, uint64_t pairs, int threads) {
+    des_key_schedule schedule;
+    des_key_setup(key, &schedule);
+    uint64_t* blocks = (uint64_t*)des_malloc(ROUNDS_STATS_CHUNK * sizeof(uint64_t));
+    sbox_histogram* histogram = (sbox_histogram*)des_calloc(1, sizeof(sbox_histogram));
+    if (blocks == NULL || histogram == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(blocks);
+        des_free(histogram);
+        return 1;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    int status = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint64_t done = 0; done < pairs && status == 0;) {
+        size_t count = pairs - done < ROUNDS_STATS_CHUNK ? (size_t)(pairs - done) : ROUNDS_STATS_CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            blocks[i] = state;
+        }
+        status = des_rounds_evaluate_pairs(&schedule, rounds, 0, blocks, difference, blocks, count, threads, histogram) == 0 ? 0 : 1;
+        done += count;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (status == 0) {
+        printf("%llu pairs through %d rounds in %.2f s (%.1f million pairs/s)\n", (unsigned long long)pairs, rounds, seconds,
+            pairs / seconds / 1e6);
+        printf("round   active share of S1 .. S8\n");
+        for (int i = 0; i < rounds; i++) {
+            printf("%5d  ", i + 1);
+            for (int s = 0; s < 8; s++) {
+                printf(" %7.4f", pairs > 0 ? 1.0 - (double)histogram->inputs[i][s][0] / pairs : 0.0);
+            }
+            printf("\n");
+        }
+    }
+    des_free(blocks);
+    des_free(histogram);
+    return status;
+}
+
+
+//// -----------------------container part-----------------------
+//
+// Seekable chunked container layout (all integers big-endian):
+//   header   : "DESC", version, algorithm, mode, reserved, chunk size (4), reserved (4), IV/nonce (8)
+//   chunks   : every chunk encrypted on its own, chunk i holds plaintext bytes [i * chunk size, ...)
+//   index    : per chunk, file offset (8), plaintext length (4), stored length (4)
+//   trailer  : index offset (8), chunk count (4), "DESI"
+//
+// ECB and CBC chunks are zero padded to whole blocks; the index keeps the real length.
+// CBC chunks use E(IV ^ chunk number) as their IV, CTR chunks start their counter at
+// IV + chunk number * blocks per chunk, so no chunk depends on another one.
+
+#define CONTAINER_VERSION 1
+#define CONTAINER_ALGORITHM_DES 1
+#define CONTAINER_HEADER_SIZE 24
+#define CONTAINER_INDEX_ENTRY_SIZE 16
+#define CONTAINER_TRAILER_SIZE 16
+
+
+/// <summary>
+/// Index entry of a single encrypted chunk.
+/// </summary>
+typedef struct container_chunk {
+    uint64_t offset;
+    uint32_t plain_length;
+    uint32_t stored_length;
+} container_chunk;
+
+
+/// <summary>
+/// State of a container being written. Data is appended in any sizes and flushed chunk by chunk.
+/// </summary>
+typedef struct container_writer {
+    FILE* file;
+    const des_key_schedule* schedule;
+    int mode;
+    unsigned char iv[BLOCK_BYTES];
+    uint32_t chunk_size;
+    unsigned char* plain;
+    unsigned char* cipher;
+    uint32_t filled;
+    uint64_t position;
+    container_chunk* chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+} container_writer;
+
+
+/// <summary>
+/// State of an opened container. The whole index is kept in memory.
+/// </summary>
+typedef struct container_reader {
+    FILE* file;
+    const des_key_schedule* schedule;
+    int mode;
+    unsigned char iv[BLOCK_BYTES];
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    container_chunk* chunks;
+    uint64_t plain_size;
+} container_reader;
+
+
+/// <summary>
+/// Seeks to an absolute 64-bit file offset.
+/// </summary>
+/// <returns>0 on success, non-zero on failure</returns>
+static int file_seek(FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+
+/// <summary>
+/// Returns the size of a seekable file, leaving the position at its end.
+/// </summary>
+/// <returns>0 on success, non-zero on failure</returns>
+static int file_size(FILE* file, uint64_t* size) {
+#ifdef _WIN32
+    __int64 end = _fseeki64(file, 0, SEEK_END) == 0 ? _ftelli64(file) : -1;
+#else
+    off_t end = fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : -1;
+#endif
+    if (end < 0) {
+        return -1;
+    }
+    *size = (uint64_t)end;
+    return 0;
+}
+
+
+/// <summary>
+/// Encrypts or decrypts one chunk, deriving its IV or counter from the chunk number.
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="mode">MODE_ECB, MODE_CBC or MODE_CTR</param>
+/// <param name="iv">Container IV/nonce</param>
+/// <param name="chunk_size">Plaintext size of a full chunk</param>
+/// <param name="index">Chunk number</param>
+/// <param name="in">Input bytes</param>
+/// <param name="out">Output bytes</param>
+/// <param name="length">Stored length of the chunk</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+static void container_crypt_chunk(const des_key_schedule* schedule, int mode, const unsigned char* iv, uint32_t chunk_size,
+    uint32_t index, const unsigned char* in, unsigned char* out, uint32_t length, int decrypt) {
+    if (mode == MODE_CTR) {
+        des_ctr_crypt(schedule, load_be64(iv) + (uint64_t)index * (chunk_size / BLOCK_BYTES), in, out, length);
+    }
+    else if (mode == MODE_CBC) {
+        unsigned char chunk_iv[BLOCK_BYTES];
+        store_be64(chunk_iv, des_crypt_block(load_be64(iv) ^ index, schedule, 0));
+        if (decrypt) {
+            des_cbc_decrypt(schedule, chunk_iv, in, out, length / BLOCK_BYTES);
+        }
+        else {
+            des_cbc_encrypt(schedule, chunk_iv, in, out, length / BLOCK_BYTES);
+        }
+    }
+    else {
+        des_ecb_crypt(schedule, in, out, length / BLOCK_BYTES, decrypt);
+    }
+}
+
+
+/// <summary>
+/// Starts a new container and writes its header.
+/// </summary>
+/// <param name="file">File opened for binary writing</param>
+/// <param name="schedule">Key schedule, must stay valid until container_finish</param>
+/// <param name="mode">MODE_ECB, MODE_CBC or MODE_CTR</param>
+/// <param name="iv">8-byte IV/nonce (ignored for ECB)</param>
+/// <param name="chunk_size">Plaintext bytes per chunk, a non-zero multiple of 8</param>
+/// <returns>Writer state, or NULL on failure</returns>
+/// <remarks>Memory is allocated internally and released by container_finish.</remarks>
+container_writer* container_create(FILE* file, const des_key_schedule* schedule, int mode, const unsigned char* iv, uint32_t chunk_size) {
+    if (chunk_size == 0 || chunk_size % BLOCK_BYTES != 0 || mode < MODE_ECB || mode > MODE_CTR) {
+        fprintf(stderr, "Invalid container parameters.\n");
+        return NULL;
+    }
+    container_writer* writer = (container_writer*)des_calloc(1, sizeof(container_writer));
+    if (writer == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return NULL;
+    }
+    writer->plain = (unsigned char*)des_malloc(chunk_size);
+    writer->cipher = (unsigned char*)des_malloc(chunk_size);
+    if (writer->plain == NULL || writer->cipher == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(writer->plain);
+        des_free(writer->cipher);
+        des_free(writer);
+        return NULL;
+    }
+    writer->file = file;
+    writer->schedule = schedule;
+    writer->mode = mode;
+    writer->chunk_size = chunk_size;
+    if (iv != NULL) {
+        memcpy(writer->iv, iv, BLOCK_BYTES);
+    }
+
+    unsigned char header[CONTAINER_HEADER_SIZE] = { 'D', 'E', 'S', 'C', CONTAINER_VERSION, CONTAINER_ALGORITHM_DES, (unsigned char)mode, 0 };
+    store_be32(header + 8, chunk_size);
+    memcpy(header + 16, writer->iv, BLOCK_BYTES);
+    if (fwrite(header, 1, CONTAINER_HEADER_SIZE, file) != CONTAINER_HEADER_SIZE) {
+        fprintf(stderr, "Failed to write container header.\n");
+        des_free(writer->plain);
+        des_free(writer->cipher);
+        des_free(writer);
+        return NULL;
+    }
+    writer->position = CONTAINER_HEADER_SIZE;
+    return writer;
+}
+
+
+/// <summary>
+/// Encrypts the pending chunk and writes it out.
+/// </summary>
+/// <returns>0 on success, -1 on failure</returns>
+static int container_flush_chunk(container_writer* writer) {
+    if (writer->chunk_count == writer->chunk_capacity) {
+        uint32_t capacity = writer->chunk_capacity ? writer->chunk_capacity * 2 : 64;
+        container_chunk* chunks = (container_chunk*)des_realloc(writer->chunks, capacity * sizeof(container_chunk));
+        if (chunks == NULL) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            return -1;
+        }
+        writer->chunks = chunks;
+        writer->chunk_capacity = capacity;
+    }
+
+    uint32_t stored_length = writer->filled;
+    if (writer->mode != MODE_CTR) {
+        stored_length = (stored_length + BLOCK_BYTES - 1) / BLOCK_BYTES * BLOCK_BYTES;
+        memset(writer->plain + writer->filled, 0, stored_length - writer->filled);
+    }
+    container_crypt_chunk(writer->schedule, writer->mode, writer->iv, writer->chunk_size, writer->chunk_count,
+        writer->plain, writer->cipher, stored_length, 0);
+    if (fwrite(writer->cipher, 1, stored_length, writer->file) != stored_length) {
+        fprintf(stderr, "Failed to write container chunk.\n");
+        return -1;
+    }
+
+    container_chunk* chunk = &writer->chunks[writer->chunk_count++];
+    chunk->offset = writer->position;
+    chunk->plain_length = writer->filled;
+    chunk->stored_length = stored_length;
+    writer->position += stored_length;
+    writer->filled = 0;
+    return 0;
+}
+
+
+/// <summary>
+/// Appends plaintext to the container, writing every chunk as soon as it is full.
+/// </summary>
+/// <param name="writer">Writer returned by container_create</param>
+/// <param name="data">Plaintext bytes</param>
+/// <param name="length">Number of bytes</param>
+/// <returns>0 on success, -1 on failure</returns>
+int container_append(container_writer* writer, const unsigned char* data, size_t length) {
+    while (length > 0) {
+        size_t n = writer->chunk_size - writer->filled;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(writer->plain + writer->filled, data, n);
+        writer->filled += (uint32_t)n;
+        data += n;
+        length -= n;
+        if (writer->filled == writer->chunk_size && container_flush_chunk(writer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Writes the last partial chunk, the chunk index and the trailer, and frees the writer.
+/// </summary>
+/// <param name="writer">Writer returned by container_create</param>
+/// <returns>0 on success, -1 on failure</returns>
+int container_finish(container_writer* writer) {
+    int status = 0;
+    if (writer->filled > 0) {
+        status = container_flush_chunk(writer);
+    }
+
+    unsigned char entry[CONTAINER_INDEX_ENTRY_SIZE];
+    for (uint32_t i = 0; status == 0 && i < writer->chunk_count; i++) {
+        store_be64(entry, writer->chunks[i].offset);
+        store_be32(entry + 8, writer->chunks[i].plain_length);
+        store_be32(entry + 12, writer->chunks[i].stored_length);
+        if (fwrite(entry, 1, CONTAINER_INDEX_ENTRY_SIZE, writer->file) != CONTAINER_INDEX_ENTRY_SIZE) {
+            status = -1;
+        }
+    }
+
+    unsigned char trailer[CONTAINER_TRAILER_SIZE];
+    store_be64(trailer, writer->position);
+    store_be32(trailer + 8, writer->chunk_count);
+    memcpy(trailer + 12, "DESI", 4);
+    if (status == 0 && fwrite(trailer, 1, CONTAINER_TRAILER_SIZE, writer->file) != CONTAINER_TRAILER_SIZE) {
+        status = -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Failed to write container index.\n");
+    }
+
+    des_free(writer->plain);
+    des_free(writer->cipher);
+    des_free(writer->chunks);
+    des_free(writer);
+    return status;
+}
+
+
+/// <summary>
+/// Opens a container: reads and validates the header, the trailer and the chunk index.
+/// The chunk count is bounded by the bytes between the index offset and the trailer, and
+/// every chunk has to lie between the header and the index.
+/// </summary>
+/// <param name="file">File opened for binary reading</param>
+/// <param name="schedule">Key schedule, must stay valid until container_close</param>
+/// <returns>Reader state, or NULL if the file is not a valid container</returns>
+/// <remarks>Memory is allocated internally and released by container_close.</remarks>
+container_reader* container_open(FILE* file, const des_key_schedule* schedule) {
+    unsigned char header[CONTAINER_HEADER_SIZE];
+    unsigned char trailer[CONTAINER_TRAILER_SIZE];
+    if (file_seek(file, 0) != 0 || fread(header, 1, CONTAINER_HEADER_SIZE, file) != CONTAINER_HEADER_SIZE
+        || memcmp(header, "DESC", 4) != 0 || header[4] != CONTAINER_VERSION || header[5] != CONTAINER_ALGORITHM_DES
+        || header[6] > MODE_CTR) {
+        fprintf(stderr, "Invalid container header.\n");
+        return NULL;
+    }
+    uint64_t size = 0;
+    if (file_size(file, &size) != 0 || size < CONTAINER_HEADER_SIZE + CONTAINER_TRAILER_SIZE
+        || file_seek(file, size - CONTAINER_TRAILER_SIZE) != 0
+        || fread(trailer, 1, CONTAINER_TRAILER_SIZE, file) != CONTAINER_TRAILER_SIZE || memcmp(trailer + 12, "DESI", 4) != 0) {
+        fprintf(stderr, "Invalid container trailer.\n");
+        return NULL;
+    }
+    uint64_t index_offset = load_be64(trailer);
+    uint64_t index_end = size - CONTAINER_TRAILER_SIZE;
+    if (index_offset < CONTAINER_HEADER_SIZE || index_offset > index_end
+        || load_be32(trailer + 8) > (index_end - index_offset) / CONTAINER_INDEX_ENTRY_SIZE) {
+        fprintf(stderr, "Invalid container trailer.\n");
+        return NULL;
+    }
+
+    container_reader* reader = (container_reader*)des_calloc(1, sizeof(container_reader));
+    if (reader == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return NULL;
+    }
+    reader->file = file;
+    reader->schedule = schedule;
+    reader->mode = header[6];
+    reader->chunk_size = load_be32(header + 8);
+    memcpy(reader->iv, header + 16, BLOCK_BYTES);
+    reader->chunk_count = load_be32(trailer + 8);
+    reader->chunks = (container_chunk*)des_malloc(((size_t)reader->chunk_count + 1) * sizeof(container_chunk));
+    if (reader->chunks == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(reader);
+        return NULL;
+    }
+
+    int valid = reader->chunk_size != 0 && reader->chunk_size % BLOCK_BYTES == 0 && file_seek(file, index_offset) == 0;
+    unsigned char entry[CONTAINER_INDEX_ENTRY_SIZE];
+    for (uint32_t i = 0; valid && i < reader->chunk_count; i++) {
+        if (fread(entry, 1, CONTAINER_INDEX_ENTRY_SIZE, file) != CONTAINER_INDEX_ENTRY_SIZE) {
+            valid = 0;
+            break;
+        }
+        container_chunk* chunk = &reader->chunks[i];
+        chunk->offset = load_be64(entry);
+        chunk->plain_length = load_be32(entry + 8);
+        chunk->stored_length = load_be32(entry + 12);
+        // every chunk but the last one is full, which is what makes offset -> chunk a division
+        // ECB and CBC decrypt whole blocks only, a partial one would leave plaintext bytes unset
+        valid = chunk->plain_length <= reader->chunk_size && chunk->stored_length <= reader->chunk_size
+            && chunk->plain_length <= chunk->stored_length
+            && (reader->mode == MODE_CTR || chunk->stored_length % BLOCK_BYTES == 0)
+            && chunk->offset >= CONTAINER_HEADER_SIZE && chunk->offset <= index_offset
+            && chunk->stored_length <= index_offset - chunk->offset
+            && (i + 1 == reader->chunk_count || chunk->plain_length == reader->chunk_size);
+        reader->plain_size += chunk->plain_length;
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid container index.\n");
+        des_free(reader->chunks);
+        des_free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+
+/// <summary>
+/// Returns the total plaintext size stored in the container.
+/// </summary>
+uint64_t container_plain_size(const container_reader* reader) {
+    return reader->plain_size;
+}
+
+
+/// <summary>
+/// Arguments shared by the chunk decryption tasks of container_read_range.
+/// </summary>
+typedef struct container_range_job {
+    const container_reader* reader;
+    uint32_t first_chunk;
+    const unsigned char* cipher;
+    unsigned char* plain;
+    const size_t* offsets;
+} container_range_job;
+
+
+/// <summary>
+/// parallel_for task decrypting one chunk of a range.
+/// </summary>
+static void container_decrypt_task(void* context, int index) {
+    container_range_job* job = (container_range_job*)context;
+    const container_reader* reader = job->reader;
+    uint32_t chunk_index = job->first_chunk + index;
+    container_crypt_chunk(reader->schedule, reader->mode, reader->iv, reader->chunk_size, chunk_index,
+        job->cipher + job->offsets[index], job->plain + job->offsets[index], reader->chunks[chunk_index].stored_length, 1);
+}
+
+
+/// <summary>
+/// Decrypts an arbitrary plaintext byte range. Only the chunks overlapping the range are
+/// read, and they are decrypted in parallel.
+/// </summary>
+/// <param name="reader">Reader returned by container_open</param>
+/// <param name="offset">Plaintext offset of the first byte</param>
+/// <param name="length">Number of bytes, offset + length must not exceed the plaintext size</param>
+/// <param name="out">Destination for length bytes</param>
+/// <param name="threads">Number of decryption threads, 0 for one per hardware thread</param>
+/// <returns>0 on success, -1 on failure</returns>
+int container_read_range(container_reader* reader, uint64_t offset, size_t length, unsigned char* out, int threads) {
+    if (offset > reader->plain_size || length > reader->plain_size - offset) {
+        fprintf(stderr, "Container range out of bounds.\n");
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    uint32_t first_chunk = (uint32_t)(offset / reader->chunk_size);
+    uint32_t last_chunk = (uint32_t)((offset + length - 1) / reader->chunk_size);
+    int count = (int)(last_chunk - first_chunk + 1);
+    size_t* offsets = (size_t*)des_malloc((count + 1) * sizeof(size_t));
+    if (offsets == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    offsets[0] = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i + 1] = offsets[i] + reader->chunks[first_chunk + i].stored_length;
+    }
+
+    unsigned char* cipher = (unsigned char*)des_malloc(offsets[count]);
+    unsigned char* plain = (unsigned char*)des_malloc(offsets[count]);
+    if (cipher == NULL || plain == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(offsets);
+        des_free(cipher);
+        des_free(plain);
+        return -1;
+    }
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        const container_chunk* chunk = &reader->chunks[first_chunk + i];
+        if (file_seek(reader->file, chunk->offset) != 0
+            || fread(cipher + offsets[i], 1, chunk->stored_length, reader->file) != chunk->stored_length) {
+            fprintf(stderr, "Failed to read container chunk %u.\n", first_chunk + i);
+            status = -1;
+            break;
+        }
+    }
+
+    if (status == 0) {
+        container_range_job job = { reader, first_chunk, cipher, plain, offsets };
+        parallel_for(count, threads, container_decrypt_task, &job);
+        memcpy(out, plain + (offset - (uint64_t)first_chunk * reader->chunk_size), length);
+    }
+
+    des_free(offsets);
+    des_free(cipher);
+    des_free(plain);
+    return status;
+}
+
+
+/// <summary>
+/// Frees a reader. The file itself is left open for the caller to close.
+/// </summary>
+void container_close(container_reader* reader) {
+    des_free(reader->chunks);
+    des_free(reader);
+}
+
+//// -----------------------streaming part-----------------------
+//
+// Constant-memory filter: a reader thread fills fixed-size buffers from the input, the
+// calling thread encrypts them in place and a writer thread drains them to the output.
+// The buffers cycle through STREAM_SLOTS slots, so at most STREAM_SLOTS buffers exist
+// no matter how long the input is. ECB and CBC use PKCS#5 padding, the other modes need
+// none. OFB takes its keystream from an ofb_prefetcher running alongside the pipeline.
+
+#define STREAM_BUFFER_SIZE (1 << 20)
+#define STREAM_SLOTS 4
+#define SLOT_FREE 0
+#define SLOT_READ 1
+#define SLOT_CRYPTED 2
+
+
+/// <summary>
+/// One buffer of the pipeline. Input is read at data + BLOCK_BYTES, which leaves room to
+/// prepend the bytes carried over from the previous buffer and to append padding.
+/// </summary>
+typedef struct stream_slot {
+    unsigned char* data;
+    size_t offset;
+    size_t length;
+    int eof;
+    int state;
+} stream_slot;
+
+
+/// <summary>
+/// Shared state of the reader, compute and writer stages.
+/// </summary>
+typedef struct stream_pipeline {
+    FILE* in;
+    FILE* out;
+    size_t buffer_size;
+    stream_slot slots[STREAM_SLOTS];
+    std::mutex lock;
+    std::condition_variable changed;
+    int failed;
+} stream_pipeline;
+
+
+/// <summary>
+/// Cipher state carried from one buffer to the next.
+/// </summary>
+typedef struct stream_cipher {
+    const des_key_schedule* schedule;
+    int mode;
+    int decrypt;
+    unsigned char chain[BLOCK_BYTES];
+    uint64_t counter;
+    unsigned char carry[BLOCK_BYTES];
+    size_t carry_length;
+    ofb_prefetcher* prefetcher;
+} stream_cipher;
+
+
+/// <summary>
+/// Waits until a slot reaches the given state or the pipeline fails.
+/// </summary>
+/// <returns>The slot, or NULL if the pipeline failed</returns>
+static stream_slot* stream_wait_slot(stream_pipeline* pipeline, int index, int state) {
+    std::unique_lock<std::mutex> guard(pipeline->lock);
+    pipeline->changed.wait(guard, [&] { return pipeline->slots[index].state == state || pipeline->failed; });
+    return pipeline->failed ? NULL : &pipeline->slots[index];
+}
+
+
+/// <summary>
+/// Hands a slot over to the next stage.
+/// </summary>
+static void stream_release_slot(stream_pipeline* pipeline, stream_slot* slot, int state) {
+    {
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        slot->state = state;
+    }
+    pipeline->changed.notify_all();
+}
+
+
+/// <summary>
+/// Stops every stage of the pipeline.
+/// </summary>
+static void stream_fail(stream_pipeline* pipeline) {
+    {
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        pipeline->failed = 1;
+    }
+    pipeline->changed.notify_all();
+}
+
+
+/// <summary>
+/// Reader stage: fills free slots from the input until end of file.
+/// </summary>
+static void stream_reader(stream_pipeline* pipeline) {
+    for (int i = 0;; i = (i + 1) % STREAM_SLOTS) {
+        stream_slot* slot = stream_wait_slot(pipeline, i, SLOT_FREE);
+        if (slot == NULL) {
+            return;
+        }
+        slot->length = fread(slot->data + BLOCK_BYTES, 1, pipeline->buffer_size, pipeline->in);
+        int eof = slot->length < pipeline->buffer_size;
+        slot->eof = eof;
+        if (eof && ferror(pipeline->in)) {
+            fprintf(stderr, "Failed to read input.\n");
+            stream_fail(pipeline);
+            return;
+        }
+        // a released slot belongs to the next stage, so it is not looked at again
+        stream_release_slot(pipeline, slot, SLOT_READ);
+        if (eof) {
+            return;
+        }
+    }
+}
+
+
+/// <summary>
+/// Writer stage: drains processed slots to the output until the last one.
+/// </summary>
+static void stream_writer(stream_pipeline* pipeline) {
+    for (int i = 0;; i = (i + 1) % STREAM_SLOTS) {
+        stream_slot* slot = stream_wait_slot(pipeline, i, SLOT_CRYPTED);
+        if (slot == NULL) {
+            return;
+        }
+        if (fwrite(slot->data + slot->offset, 1, slot->length, pipeline->out) != slot->length
+            || (slot->eof && fflush(pipeline->out) != 0)) {
+            fprintf(stderr, "Failed to write output.\n");
+            stream_fail(pipeline);
+            return;
+        }
+        if (slot->eof) {
+            return;
+        }
+        stream_release_slot(pipeline, slot, SLOT_FREE);
+    }
+}
+
+
+/// <summary>
+/// Compute stage for one slot: prepends the carried bytes, processes every complete block,
+/// and carries the rest into the next slot. Padding is added or removed at end of file.
+/// On return slot->offset and slot->length describe the output bytes.
+/// </summary>
+/// <returns>0 on success, -1 on invalid input</returns>
+static int stream_crypt_slot(stream_cipher* cipher, stream_slot* slot) {
+    int padded = cipher->mode == MODE_ECB || cipher->mode == MODE_CBC;
+    size_t start = BLOCK_BYTES - cipher->carry_length;
+    unsigned char* buffer = slot->data + start;
+    memcpy(buffer, cipher->carry, cipher->carry_length);
+    size_t total = cipher->carry_length + slot->length;
+
+    size_t process = total / BLOCK_BYTES * BLOCK_BYTES;
+    if (slot->eof) {
+        if (padded && !cipher->decrypt) {
+            unsigned char pad = (unsigned char)(BLOCK_BYTES - total % BLOCK_BYTES);
+            memset(buffer + total, pad, pad);
+            total += pad;
+        }
+        else if (padded && (total == 0 || total % BLOCK_BYTES != 0)) {
+            fprintf(stderr, "Encrypted input length is not a multiple of %d bytes.\n", BLOCK_BYTES);
+            return -1;
+        }
+        process = total;
+    }
+    else if (padded && cipher->decrypt && process == total && process > 0) {
+        process -= BLOCK_BYTES; // keep the last block until we know whether it holds the padding
+    }
+
+    size_t blocks = process / BLOCK_BYTES;
+    if (cipher->mode == MODE_CTR) {
+        des_ctr_crypt(cipher->schedule, cipher->counter, buffer, buffer, process);
+        cipher->counter += blocks;
+    }
+    else if (cipher->mode == MODE_CBC && blocks > 0) {
+        unsigned char next_chain[BLOCK_BYTES];
+        if (cipher->decrypt) {
+            memcpy(next_chain, buffer + process - BLOCK_BYTES, BLOCK_BYTES);
+            des_cbc_decrypt(cipher->schedule, cipher->chain, buffer, buffer, blocks);
+        }
+        else {
+            des_cbc_encrypt(cipher->schedule, cipher->chain, buffer, buffer, blocks);
+            memcpy(next_chain, buffer + process - BLOCK_BYTES, BLOCK_BYTES);
+        }
+        memcpy(cipher->chain, next_chain, BLOCK_BYTES);
+    }
+    else if (cipher->mode == MODE_ECB) {
+        des_ecb_crypt(cipher->schedule, buffer, buffer, blocks, cipher->decrypt);
+    }
+    else if (cipher->mode == MODE_OFB) {
+        ofb_prefetch_crypt(cipher->prefetcher, buffer, buffer, process);
+    }
+    else if (process > 0) {
+        // CFB and CFB-8: the last ciphertext block is the next shift register
+        // (process is whole blocks unless this is the last slot)
+        unsigned char next_chain[BLOCK_BYTES];
+        memcpy(next_chain, cipher->chain, BLOCK_BYTES);
+        if (process >= BLOCK_BYTES && cipher->decrypt) {
+            memcpy(next_chain, buffer + process - BLOCK_BYTES, BLOCK_BYTES);
+        }
+        des_stream_mode_crypt(cipher->schedule, cipher->mode, cipher->decrypt, cipher->chain, buffer, buffer, process);
+        if (process >= BLOCK_BYTES && !cipher->decrypt) {
+            memcpy(next_chain, buffer + process - BLOCK_BYTES, BLOCK_BYTES);
+        }
+        memcpy(cipher->chain, next_chain, BLOCK_BYTES);
+    }
+
+    cipher->carry_length = total - process;
+    memcpy(cipher->carry, buffer + process, cipher->carry_length);
+
+    if (slot->eof && padded && cipher->decrypt) {
+        unsigned char pad = buffer[process - 1];
+        if (pad == 0 || pad > BLOCK_BYTES) {
+            fprintf(stderr, "Invalid padding.\n");
+            return -1;
+        }
+        for (size_t i = process - pad; i < process; i++) {
+            if (buffer[i] != pad) {
+                fprintf(stderr, "Invalid padding.\n");
+                return -1;
+            }
+        }
+        process -= pad;
+    }
+    slot->offset = start;
+    slot->length = process;
+    return 0;
+}
+
+
+/// <summary>
+/// Encrypts or decrypts everything from in to out with bounded memory.
+/// </summary>
+/// <param name="in">Input stream, e.g. stdin or a pipe</param>
+/// <param name="out">Output stream</param>
+/// <param name="schedule">Key schedule</param>
+/// <param name="mode">One of the cipher_mode values</param>
+/// <param name="iv">8-byte IV, or initial counter for CTR; ignored for ECB</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+/// <returns>0 on success, -1 on failure</returns>
+int stream_filter(FILE* in, FILE* out, const des_key_schedule* schedule, int mode, const unsigned char* iv, int decrypt) {
+    stream_pipeline* pipeline = new stream_pipeline();
+    pipeline->in = in;
+    pipeline->out = out;
+    pipeline->buffer_size = STREAM_BUFFER_SIZE;
+    pipeline->failed = 0;
+    for (int i = 0; i < STREAM_SLOTS; i++) {
+        pipeline->slots[i].data = (unsigned char*)des_malloc(STREAM_BUFFER_SIZE + 2 * BLOCK_BYTES);
+        pipeline->slots[i].state = SLOT_FREE;
+        if (pipeline->slots[i].data == NULL) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            pipeline->failed = 1;
+        }
+    }
+
+    stream_cipher cipher = { schedule, mode, decrypt, { 0 }, 0, { 0 }, 0, NULL };
+    if (iv != NULL) {
+        memcpy(cipher.chain, iv, BLOCK_BYTES);
+        cipher.counter = load_be64(iv);
+    }
+    if (mode == MODE_OFB) {
+        cipher.prefetcher = ofb_prefetcher_create(schedule, cipher.chain);
+    }
+
+    if (!pipeline->failed) {
+        std::thread reader(stream_reader, pipeline);
+        std::thread writer(stream_writer, pipeline);
+        for (int i = 0;; i = (i + 1) % STREAM_SLOTS) {
+            stream_slot* slot = stream_wait_slot(pipeline, i, SLOT_READ);
+            if (slot == NULL) {
+                break;
+            }
+            if (stream_crypt_slot(&cipher, slot) != 0) {
+                stream_fail(pipeline);
+                break;
+            }
+            // once released, the writer and the reader may recycle the slot before we look at it again
+            int eof = slot->eof;
+            stream_release_slot(pipeline, slot, SLOT_CRYPTED);
+            if (eof) {
+                break;
+            }
+        }
+        reader.join();
+        writer.join();
+    }
+
+    int status = pipeline->failed ? -1 : 0;
+    for (int i = 0; i < STREAM_SLOTS; i++) {
+        des_free(pipeline->slots[i].data);
+    }
+    ofb_prefetcher_destroy(cipher.prefetcher);
+    delete pipeline;
+    return status;
+}
+
+
+//// -----------------------scatter-gather part-----------------------
+//
+// des_encryptv and des_decryptv work on chains of buffers described by iovec arrays, as
+// used by readv and writev. Wherever the input and output fragments both hold whole blocks
+// the mode runs directly on the fragments; a block split across fragment boundaries is
+// gathered into an 8-byte carry buffer, processed there and scattered to the output.
+// The output may describe the same memory as the input with the same layout (in place),
+// or memory that does not overlap the input at all. There is no padding: ECB and CBC
+// need a total length that is a multiple of 8.
+
+
+/// <summary>
+/// Position inside an iovec array.
+/// </summary>
+typedef struct iovec_cursor {
+    const struct iovec* vectors;
+    int count;
+    int index;
+    size_t offset;
+} iovec_cursor;
+
+
+/// <summary>
+/// Chain state carried from one run of blocks to the next.
+/// </summary>
+typedef struct vector_cipher {
+    const des_key_schedule* schedule;
+    int mode;
+    int decrypt;
+    unsigned char chain[BLOCK_BYTES];
+    uint64_t counter;
+} vector_cipher;
+
+
+/// <summary>
+/// Returns the number of contiguous bytes left at the cursor, skipping empty fragments.
+/// </summary>
+static size_t iovec_available(iovec_cursor* cursor) {
+    while (cursor->index < cursor->count && cursor->offset == cursor->vectors[cursor->index].iov_len) {
+        cursor->index++;
+        cursor->offset = 0;
+    }
+    return cursor->index < cursor->count ? cursor->vectors[cursor->index].iov_len - cursor->offset : 0;
+}
+
+
+/// <summary>
+/// Returns the address at the cursor.
+/// </summary>
+static unsigned char* iovec_pointer(const iovec_cursor* cursor) {
+    return (unsigned char*)cursor->vectors[cursor->index].iov_base + cursor->offset;
+}
+
+
+/// <summary>
+/// Copies bytes between a cursor and a flat buffer, advancing the cursor.
+/// </summary>
+/// <param name="cursor">Position in the iovec array</param>
+/// <param name="buffer">Flat buffer</param>
+/// <param name="length">Number of bytes, must be available</param>
+/// <param name="to_vectors">Non-zero to copy from buffer into the vectors, zero for the other way</param>
+static void iovec_copy(iovec_cursor* cursor, unsigned char* buffer, size_t length, int to_vectors) {
+    while (length > 0) {
+        size_t n = iovec_available(cursor);
+        n = n < length ? n : length;
+        if (to_vectors) {
+            memcpy(iovec_pointer(cursor), buffer, n);
+        }
+        else {
+            memcpy(buffer, iovec_pointer(cursor), n);
+        }
+        cursor->offset += n;
+        buffer += n;
+        length -= n;
+    }
+}
+
+
+/// <summary>
+/// Processes a contiguous run of bytes and updates the chain state. The length is a
+/// multiple of 8, except for the last run of a CTR operation.
+/// </summary>
+static void vector_crypt_run(vector_cipher* cipher, const unsigned char* in, unsigned char* out, size_t length) {
+    size_t blocks = length / BLOCK_BYTES;
+    if (cipher->mode == MODE_CTR) {
+        des_ctr_crypt(cipher->schedule, cipher->counter, in, out, length);
+        cipher->counter += blocks;
+    }
+    else if (cipher->mode == MODE_CBC && cipher->decrypt) {
+        unsigned char next_chain[BLOCK_BYTES];
+        memcpy(next_chain, in + length - BLOCK_BYTES, BLOCK_BYTES);
+        des_cbc_decrypt(cipher->schedule, cipher->chain, in, out, blocks);
+        memcpy(cipher->chain, next_chain, BLOCK_BYTES);
+    }
+    else if (cipher->mode == MODE_CBC) {
+        des_cbc_encrypt(cipher->schedule, cipher->chain, in, out, blocks);
+        memcpy(cipher->chain, out + length - BLOCK_BYTES, BLOCK_BYTES);
+    }
+    else {
+        des_ecb_crypt(cipher->schedule, in, out, blocks, cipher->decrypt);
+    }
+}
+
+
+/// <summary>
+/// Shared implementation of des_encryptv and des_decryptv.
+/// </summary>
+static int des_cryptv(const des_key_schedule* schedule, int mode, const unsigned char* iv, const struct iovec* in, int in_count,
+    const struct iovec* out, int out_count, int decrypt) {
+    size_t in_total = 0, out_total = 0;
+    for (int i = 0; i < in_count; i++) {
+        in_total += in[i].iov_len;
+    }
+    for (int i = 0; i < out_count; i++) {
+        out_total += out[i].iov_len;
+    }
+    if (mode < MODE_ECB || mode > MODE_CTR || out_total < in_total || (mode != MODE_CTR && in_total % BLOCK_BYTES != 0)
+        || (mode != MODE_ECB && iv == NULL)) {
+        fprintf(stderr, "Invalid scatter-gather parameters.\n");
+        return -1;
+    }
+
+    vector_cipher cipher = { schedule, mode, decrypt, { 0 }, 0 };
+    if (iv != NULL) {
+        memcpy(cipher.chain, iv, BLOCK_BYTES);
+        cipher.counter = load_be64(iv);
+    }
+    iovec_cursor source = { in, in_count, 0, 0 };
+    iovec_cursor target = { out, out_count, 0, 0 };
+    size_t remaining = in_total;
+
+    while (remaining > 0) {
+        size_t in_run = iovec_available(&source);
+        size_t out_run = iovec_available(&target);
+        size_t run = (in_run < out_run ? in_run : out_run) / BLOCK_BYTES * BLOCK_BYTES;
+        if (run > 0) {
+            vector_crypt_run(&cipher, iovec_pointer(&source), iovec_pointer(&target), run);
+            source.offset += run;
+            target.offset += run;
+            remaining -= run;
+            continue;
+        }
+
+        // the next block straddles a fragment boundary (or is the short tail of CTR)
+        unsigned char carry[BLOCK_BYTES];
+        size_t n = remaining < BLOCK_BYTES ? remaining : BLOCK_BYTES;
+        iovec_copy(&source, carry, n, 0);
+        vector_crypt_run(&cipher, carry, carry, n);
+        iovec_copy(&target, carry, n, 1);
+        remaining -= n;
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Encrypts a chain of buffers into another chain (or the same one, in place).
+/// </summary>
+/// <param name="schedule">Key schedule</param>
+/// <param name="mode">MODE_ECB, MODE_CBC or MODE_CTR</param>
+/// <param name="iv">8-byte IV or initial counter, may be NULL for ECB</param>
+/// <param name="in">Input fragments</param>
+/// <param name="in_count">Number of input fragments</param>
+/// <param name="out">Output fragments, at least as many bytes in total as the input</param>
+/// <param name="out_count">Number of output fragments</param>
+/// <returns>0 on success, -1 on invalid parameters</returns>
+int des_encryptv(const des_key_schedule* schedule, int mode, const unsigned char* iv, const struct iovec* in, int in_count,
+    const struct iovec* out, int out_count) {
+    return des_cryptv(schedule, mode, iv, in, in_count, out, out_count, 0);
+}
+
+
+/// <summary>
+/// Decrypts a chain of buffers into another chain (or the same one, in place), see des_encryptv.
+/// </summary>
+int des_decryptv(const des_key_schedule* schedule, int mode, const unsigned char* iv, const struct iovec* in, int in_count,
+    const struct iovec* out, int out_count) {
+    return des_cryptv(schedule, mode, iv, in, in_count, out, out_count, 1);
+}
+
+
+//// -----------------------key cache part-----------------------
+
+#define KEY_CACHE_SLOTS 1024
+
+
+/// <summary>
+/// One cached key schedule.
+/// </summary>
+typedef struct key_cache_entry {
+    int used;
+    unsigned char key[BLOCK_BYTES];
+    des_key_schedule schedule;
+} key_cache_entry;
+
+
+/// <summary>
+/// Direct-mapped cache of key schedules, so callers that reuse a key do not pay
+/// for des_key_setup every time.
+/// </summary>
+typedef struct key_cache {
+    key_cache_entry entries[KEY_CACHE_SLOTS];
+    std::mutex lock;
+    uint64_t hits;
+    uint64_t misses;
+} key_cache;
+
+
+/// <summary>
+/// Returns the slot a key maps to.
+/// </summary>
+static key_cache_entry* key_cache_slot(key_cache* cache, const unsigned char* key) {
+    return &cache->entries[(load_be64(key) * 0x9E3779B97F4A7C15ULL) >> 54];
+}
+
+
+/// <summary>
+/// Copies the schedule for the given key out of the cache, building and caching it on a miss.
+/// </summary>
+/// <param name="cache">The cache</param>
+/// <param name="key">8-byte key</param>
+/// <param name="schedule">Receives the key schedule</param>
+void key_cache_lookup(key_cache* cache, const unsigned char* key, des_key_schedule* schedule) {
+    key_cache_entry* entry = key_cache_slot(cache, key);
+    {
+        std::lock_guard<std::mutex> guard(cache->lock);
+        if (entry->used && memcmp(entry->key, key, BLOCK_BYTES) == 0) {
+            *schedule = entry->schedule;
+            cache->hits++;
+            return;
+        }
+        cache->misses++;
+    }
+
+    des_key_setup(key, schedule);
+    std::lock_guard<std::mutex> guard(cache->lock);
+    entry->used = 1;
+    memcpy(entry->key, key, BLOCK_BYTES);
+    entry->schedule = *schedule;
+}
+
+
+/// <summary>
+/// Looks up many keys at once. The misses are built together with des_key_setup_bulk
+/// and then cached, which is how a batch of requests with fresh keys warms the cache.
+/// </summary>
+/// <param name="cache">The cache</param>
+/// <param name="keys">count pointers to 8-byte keys</param>
+/// <param name="count">Number of keys</param>
+/// <param name="schedules">count pointers receiving the key schedules</param>
+void key_cache_lookup_many(key_cache* cache, const unsigned char* const* keys, int count, des_key_schedule* const* schedules) {
+    unsigned char* miss_keys = (unsigned char*)des_malloc((size_t)count * BLOCK_BYTES + 1);
+    des_key_schedule* built = (des_key_schedule*)des_malloc((size_t)count * sizeof(des_key_schedule) + 1);
+    int* miss_index = (int*)des_malloc((size_t)count * sizeof(int) + 1);
+    if (miss_keys == NULL || built == NULL || miss_index == NULL) {
+        // one key at a time still works without the scratch arrays
+        for (int i = 0; i < count; i++) {
+            key_cache_lookup(cache, keys[i], schedules[i]);
+        }
+        des_free(miss_keys);
+        des_free(built);
+        des_free(miss_index);
+        return;
+    }
+
+    int misses = 0;
+    {
+        std::lock_guard<std::mutex> guard(cache->lock);
+        for (int i = 0; i < count; i++) {
+            key_cache_entry* entry = key_cache_slot(cache, keys[i]);
+            if (entry->used && memcmp(entry->key, keys[i], BLOCK_BYTES) == 0) {
+                *schedules[i] = entry->schedule;
+                cache->hits++;
+                continue;
+            }
+            cache->misses++;
+            memcpy(miss_keys + (size_t)misses * BLOCK_BYTES, keys[i], BLOCK_BYTES);
+            miss_index[misses++] = i;
+        }
+    }
+
+    if (misses > 0) {
+        des_key_setup_bulk(miss_keys, misses, built, 1);
+        std::lock_guard<std::mutex> guard(cache->lock);
+        for (int m = 0; m < misses; m++) {
+            key_cache_entry* entry = key_cache_slot(cache, keys[miss_index[m]]);
+            *schedules[miss_index[m]] = built[m];
+            entry->used = 1;
+            memcpy(entry->key, keys[miss_index[m]], BLOCK_BYTES);
+            entry->schedule = built[m];
+        }
+    }
+    des_free(miss_keys);
+    des_free(built);
+    des_free(miss_index);
+}
+
+
+//// -----------------------scheduler part-----------------------
+//
+// Work-stealing scheduler for a mix of tiny and huge jobs. Every worker owns a deque;
+// it pops its newest task while idle workers steal the oldest task of someone else.
+// Splittable jobs (ECB, CTR, CBC decryption out of place) start as one task covering all
+// blocks; whoever runs it pushes back the upper half until a SCHED_RANGE_BLOCKS grain
+// is left, so thieves always take the largest remaining piece. Serial jobs run on one
+// worker in SCHED_RANGE_BLOCKS segments, carrying their chain state from one to the next.
+// Small jobs are coalesced into batch tasks that live in a queue of their own, which a
+// worker looks at before its deque and again between the segments of a serial job, so a
+// small job waits for at most one grain or segment even while every worker is busy.
+
+#define SCHED_RANGE_BLOCKS 8192
+#define SCHED_SMALL_JOB_BYTES 4096
+#define SCHED_BATCH_BYTES 65536
+#define SCHED_LATENCY_SAMPLES 65536
+
+
+/// <summary>
+/// One encryption request. Fill it with crypt_job_init; the job must stay alive until
+/// it is done (see scheduler_wait_all). If on_done is set, it is called from a worker
+/// thread as the very last access to the job.
+/// While a serial job runs, iv holds its chain state.
+/// </summary>
+typedef struct crypt_job {
+    unsigned char key[BLOCK_BYTES];
+    int mode;
+    int decrypt;
+    unsigned char iv[BLOCK_BYTES];
+    const unsigned char* in;
+    unsigned char* out;
+    size_t length;
+    void (*on_done)(void* context);
+    void* on_done_context;
+
+    int schedule_ready;
+    des_key_schedule schedule;
+    std::atomic<size_t> remaining_blocks;
+    std::chrono::steady_clock::time_point submitted;
+    struct crypt_job* batch_next;
+    std::atomic<int> done;
+} crypt_job;
+
+
+/// <summary>
+/// A unit of work: a block range of a job, or a whole chain of small jobs.
+/// </summary>
+typedef struct sched_task {
+    crypt_job* job;
+    size_t first_block;
+    size_t block_count;
+    int batch;
+} sched_task;
+
+
+/// <summary>
+/// A worker thread and the deque it owns.
+/// </summary>
+typedef struct sched_worker {
+    std::deque<sched_task> tasks;
+    std::mutex lock;
+    std::thread thread;
+} sched_worker;
+
+
+/// <summary>
+/// Scheduler state.
+/// </summary>
+typedef struct scheduler {
+    int thread_count;
+    sched_worker* workers;
+    key_cache keys;
+    std::atomic<unsigned> next_worker;
+
+    std::mutex batch_lock;
+    crypt_job* batch_head;
+    crypt_job* batch_tail;
+    size_t batch_bytes;
+    std::deque<crypt_job*> full_batches;
+    std::atomic<int> batches_queued;
+
+    std::atomic<int> queued;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    int stopping;
+
+    std::atomic<int> active_jobs;
+    std::mutex idle_lock;
+    std::condition_variable idle;
+
+    std::mutex latency_lock;
+    double latency_us[SCHED_LATENCY_SAMPLES];
+    uint64_t latency_count;
+} scheduler;
+
+
+/// <summary>
+/// Fills in an encryption request.
+/// </summary>
+/// <param name="job">Job to be initialized</param>
+/// <param name="key">8-byte key</param>
+/// <param name="mode">One of the cipher_mode values</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+/// <param name="iv">8-byte IV or initial counter, may be NULL for ECB</param>
+/// <param name="in">Input bytes</param>
+/// <param name="out">Output bytes, may equal in</param>
+/// <param name="length">Number of bytes, a multiple of 8 for ECB and CBC</param>
+void crypt_job_init(crypt_job* job, const unsigned char* key, int mode, int decrypt, const unsigned char* iv,
+    const unsigned char* in, unsigned char* out, size_t length) {
+    memcpy(job->key, key, BLOCK_BYTES);
+    job->mode = mode;
+    job->decrypt = decrypt;
+    memset(job->iv, 0, BLOCK_BYTES);
+    if (iv != NULL) {
+        memcpy(job->iv, iv, BLOCK_BYTES);
+    }
+    job->in = in;
+    job->out = out;
+    job->length = length;
+    job->on_done = NULL;
+    job->on_done_context = NULL;
+    job->schedule_ready = 0;
+    job->batch_next = NULL;
+    job->done = 0;
+}
+
+
+/// <summary>
+/// Makes a job use an already built key schedule instead of looking its key up in the cache.
+/// </summary>
+void crypt_job_use_schedule(crypt_job* job, const des_key_schedule* schedule) {
+    job->schedule = *schedule;
+    job->schedule_ready = 1;
+}
+
+
+/// <summary>
+/// Returns non-zero if the job's blocks can be processed in any order.
+/// ECB and CTR are split out of place or exactly in place. CBC and CFB decryption read the
+/// previous ciphertext block, so they are only split if input and output do not overlap.
+/// Shifted output (out < in) is serial for every mode, since a later range would overwrite
+/// input an earlier one has not read yet. OFB and the other encryptions are serial.
+/// </summary>
+static int job_is_splittable(const crypt_job* job) {
+    uintptr_t in = (uintptr_t)job->in;
+    uintptr_t out = (uintptr_t)job->out;
+    if (out < in + job->length && in < out + job->length) {
+        return in == out && (job->mode == MODE_ECB || job->mode == MODE_CTR);
+    }
+    return job->mode == MODE_ECB || job->mode == MODE_CTR || (job->decrypt && job->mode != MODE_OFB);
+}
+
+
+/// <summary>
+/// Processes blocks [first_block, first_block + block_count) of a job and completes
+/// the job when its last block is done. Split ranges start from the ciphertext block
+/// before them, serial segments from the chain state in job->iv.
+/// </summary>
+static void run_job_range(scheduler* sched, crypt_job* job, size_t first_block, size_t block_count) {
+    const unsigned char* in = job->in + first_block * BLOCK_BYTES;
+    unsigned char* out = job->out + first_block * BLOCK_BYTES;
+    size_t bytes = job->length - first_block * BLOCK_BYTES;
+    if (bytes > block_count * BLOCK_BYTES) {
+        bytes = block_count * BLOCK_BYTES;
+    }
+    const unsigned char* iv = first_block == 0 || !job_is_splittable(job) ? job->iv : in - BLOCK_BYTES;
+    if (job->mode == MODE_CTR) {
+        des_ctr_crypt(&job->schedule, load_be64(job->iv) + first_block, in, out, bytes);
+    }
+    else if (job->mode > MODE_CTR) {
+        des_stream_mode_crypt(&job->schedule, job->mode, job->decrypt, iv, in, out, bytes);
+    }
+    else if (job->mode == MODE_CBC && job->decrypt) {
+        des_cbc_decrypt(&job->schedule, iv, in, out, block_count);
+    }
+    else if (job->mode == MODE_CBC) {
+        des_cbc_encrypt(&job->schedule, job->iv, in, out, block_count);
+    }
+    else {
+        des_ecb_crypt(&job->schedule, in, out, block_count, job->decrypt);
+    }
+
+    if (job->remaining_blocks.fetch_sub(block_count) != block_count) {
+        return;
+    }
+    double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - job->submitted).count();
+    {
+        std::lock_guard<std::mutex> guard(sched->latency_lock);
+        sched->latency_us[sched->latency_count++ % SCHED_LATENCY_SAMPLES] = latency;
+    }
+    void (*on_done)(void*) = job->on_done;
+    void* on_done_context = job->on_done_context;
+    job->done = 1;
+    if (on_done != NULL) {
+        on_done(on_done_context);
+    }
+    if (--sched->active_jobs == 0) {
+        std::lock_guard<std::mutex> guard(sched->idle_lock);
+        sched->idle.notify_all();
+    }
+}
+
+
+/// <summary>
+/// Pushes a task onto the bottom of a worker's deque.
+/// </summary>
+static void sched_push(scheduler* sched, sched_worker* worker, const sched_task* task, int count_it) {
+    {
+        std::lock_guard<std::mutex> guard(worker->lock);
+        worker->tasks.push_back(*task);
+    }
+    if (count_it) {
+        sched->queued++;
+        std::lock_guard<std::mutex> guard(sched->sleep_lock);
+        sched->wake.notify_one();
+    }
+}
+
+
+/// <summary>
+/// Takes the oldest full small-job batch, or else the one still being filled.
+/// </summary>
+/// <returns>Non-zero if a batch was taken</returns>
+static int sched_take_batch(scheduler* sched, sched_task* task) {
+    if (sched->batches_queued == 0) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(sched->batch_lock);
+    if (!sched->full_batches.empty()) {
+        task->job = sched->full_batches.front();
+        sched->full_batches.pop_front();
+    }
+    else if (sched->batch_head != NULL) {
+        task->job = sched->batch_head;
+        sched->batch_head = sched->batch_tail = NULL;
+        sched->batch_bytes = 0;
+    }
+    else {
+        return 0;
+    }
+    task->first_block = 0;
+    task->block_count = 0;
+    task->batch = 1;
+    sched->batches_queued--;
+    sched->queued--;
+    return 1;
+}
+
+
+/// <summary>
+/// Finds work for a worker: a small-job batch, then its own newest task, then the oldest
+/// task of another worker.
+/// </summary>
+/// <returns>Non-zero if a task was found</returns>
+static int sched_find_task(scheduler* sched, int self, sched_task* task) {
+    if (sched_take_batch(sched, task)) {
+        return 1;
+    }
+    sched_worker* own = &sched->workers[self];
+    {
+        std::lock_guard<std::mutex> guard(own->lock);
+        if (!own->tasks.empty()) {
+            *task = own->tasks.back();
+            own->tasks.pop_back();
+            sched->queued--;
+            return 1;
+        }
+    }
+    for (int i = 1; i < sched->thread_count; i++) {
+        sched_worker* victim = &sched->workers[(self + i) % sched->thread_count];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            *task = victim->tasks.front();
+            victim->tasks.pop_front();
+            sched->queued--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void sched_run_task(scheduler* sched, int self, sched_task task);
+
+
+/// <summary>
+/// Runs a job from start to end on the calling worker, in segments of SCHED_RANGE_BLOCKS.
+/// Between segments the chain state of a chaining mode goes into job->iv and waiting
+/// small-job batches run. ECB keeps no state and CTR derives its counter from job->iv.
+/// </summary>
+static void sched_run_serial(scheduler* sched, int self, crypt_job* job) {
+    size_t blocks = job->remaining_blocks;
+    int chained = job->mode != MODE_ECB && job->mode != MODE_CTR;
+    for (size_t first = 0;; first += SCHED_RANGE_BLOCKS) {
+        if (blocks - first <= SCHED_RANGE_BLOCKS) {
+            run_job_range(sched, job, first, blocks - first);
+            return;
+        }
+        // the last input block is needed after the segment, which may have overwritten it
+        unsigned char last_in[BLOCK_BYTES];
+        memcpy(last_in, job->in + (first + SCHED_RANGE_BLOCKS - 1) * BLOCK_BYTES, BLOCK_BYTES);
+        run_job_range(sched, job, first, SCHED_RANGE_BLOCKS);
+        const unsigned char* last_out = job->out + (first + SCHED_RANGE_BLOCKS - 1) * BLOCK_BYTES;
+        if (chained && job->mode == MODE_OFB) {
+            store_be64(job->iv, load_be64(last_in) ^ load_be64(last_out));
+        }
+        else if (chained && job->decrypt) {
+            memcpy(job->iv, last_in, BLOCK_BYTES);
+        }
+        else if (chained) {
+            memcpy(job->iv, last_out, BLOCK_BYTES);
+        }
+
+        sched_task batch;
+        while (sched_take_batch(sched, &batch)) {
+            sched_run_task(sched, self, batch);
+        }
+    }
+}
+
+
+/// <summary>
+/// Runs a task. Large ranges are split, pushing the upper half back so it can be stolen.
+/// </summary>
+static void sched_run_task(scheduler* sched, int self, sched_task task) {
+    DES_PROBE4(task_dispatch, self, task.first_block, task.block_count, task.batch);
+    if (task.batch) {
+        for (crypt_job* job = task.job; job != NULL;) {
+            crypt_job* next = job->batch_next;
+            sched_run_serial(sched, self, job);
+            job = next;
+        }
+        return;
+    }
+    while (task.block_count > SCHED_RANGE_BLOCKS) {
+        size_t half = task.block_count / 2;
+        sched_task upper = { task.job, task.first_block + half, task.block_count - half, 0 };
+        sched_push(sched, &sched->workers[self], &upper, 1);
+        task.block_count = half;
+    }
+    run_job_range(sched, task.job, task.first_block, task.block_count);
+}
+
+
+/// <summary>
+/// Worker thread main loop.
+/// </summary>
+static void sched_worker_main(scheduler* sched, int self) {
+    for (;;) {
+        sched_task task;
+        if (sched_find_task(sched, self, &task)) {
+            sched_run_task(sched, self, task);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sched->sleep_lock);
+        sched->wake.wait(guard, [&] { return sched->queued > 0 || sched->stopping; });
+        if (sched->stopping && sched->queued == 0) {
+            return;
+        }
+    }
+}
+
+
+/// <summary>
+/// Starts a scheduler.
+/// </summary>
+/// <param name="threads">Number of worker threads, 0 for one per hardware thread</param>
+/// <returns>The scheduler</returns>
+/// <remarks>Must be released with scheduler_destroy.</remarks>
+scheduler* scheduler_create(int threads) {
+    if (threads <= 0) {
+        threads = (int)std::thread::hardware_concurrency();
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+    init_engine_tables();
+    scheduler* sched = new scheduler();
+    sched->thread_count = threads;
+    sched->workers = new sched_worker[threads];
+    for (int i = 0; i < threads; i++) {
+        sched->workers[i].thread = std::thread(sched_worker_main, sched, i);
+    }
+    return sched;
+}
+
+
+/// <summary>
+/// Submits a job. Returns immediately; job->done becomes non-zero when it is finished.
+/// </summary>
+/// <param name="sched">The scheduler</param>
+/// <param name="job">Job filled by crypt_job_init</param>
+/// <returns>0 on success, -1 if the job is invalid</returns>
+int scheduler_submit(scheduler* sched, crypt_job* job) {
+    if (job->mode < MODE_ECB || job->mode > MODE_CFB8 || (job->mode <= MODE_CBC && job->length % BLOCK_BYTES != 0)) {
+        fprintf(stderr, "Invalid job parameters.\n");
+        return -1;
+    }
+    size_t blocks = (job->length + BLOCK_BYTES - 1) / BLOCK_BYTES;
+    if (!job->schedule_ready) {
+        key_cache_lookup(&sched->keys, job->key, &job->schedule);
+    }
+    job->remaining_blocks = blocks;
+    job->batch_next = NULL;
+    job->done = 0;
+    job->submitted = std::chrono::steady_clock::now();
+    sched->active_jobs++;
+
+    if (blocks == 0) {
+        run_job_range(sched, job, 0, 0);
+        return 0;
+    }
+
+    if (job->length <= SCHED_SMALL_JOB_BYTES) {
+        {
+            std::lock_guard<std::mutex> guard(sched->batch_lock);
+            if (sched->batch_head == NULL) {
+                sched->batch_head = job;
+                sched->batches_queued++;
+                sched->queued++;
+            }
+            else {
+                sched->batch_tail->batch_next = job;
+            }
+            sched->batch_tail = job;
+            sched->batch_bytes += job->length;
+            if (sched->batch_bytes >= SCHED_BATCH_BYTES) {
+                // the batch already counts as queued work, it only stops taking new jobs
+                sched->full_batches.push_back(sched->batch_head);
+                sched->batch_head = sched->batch_tail = NULL;
+                sched->batch_bytes = 0;
+            }
+        }
+        std::lock_guard<std::mutex> guard(sched->sleep_lock);
+        sched->wake.notify_one();
+        return 0;
+    }
+
+    // a job that cannot be split runs whole, as a batch of one job
+    sched_task task = { job, 0, blocks, !job_is_splittable(job) };
+    sched_push(sched, &sched->workers[sched->next_worker++ % sched->thread_count], &task, 1);
+    return 0;
+}
+
+
+/// <summary>
+/// Blocks until every submitted job is done.
+/// </summary>
+void scheduler_wait_all(scheduler* sched) {
+    std::unique_lock<std::mutex> guard(sched->idle_lock);
+    sched->idle.wait(guard, [&] { return sched->active_jobs == 0; });
+}
+
+
+/// <summary>
+/// Comparison function for qsort on doubles.
+/// </summary>
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+/// <summary>
+/// Reports job latency percentiles (submission to completion) over the most recent
+/// SCHED_LATENCY_SAMPLES jobs.
+/// </summary>
+/// <param name="sched">The scheduler</param>
+/// <param name="p50_us">Receives the median latency in microseconds</param>
+/// <param name="p99_us">Receives the 99th percentile latency in microseconds</param>
+/// <returns>Number of samples used, 0 if no job finished yet</returns>
+int scheduler_latency(scheduler* sched, double* p50_us, double* p99_us) {
+    double* samples = (double*)des_malloc(SCHED_LATENCY_SAMPLES * sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 0;
+    }
+    int count;
+    {
+        std::lock_guard<std::mutex> guard(sched->latency_lock);
+        count = sched->latency_count < SCHED_LATENCY_SAMPLES ? (int)sched->latency_count : SCHED_LATENCY_SAMPLES;
+        memcpy(samples, sched->latency_us, count * sizeof(double));
+    }
+    *p50_us = *p99_us = 0;
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_doubles);
+        *p50_us = samples[(count - 1) / 2];
+        *p99_us = samples[(int)((count - 1) * 0.99)];
+    }
+    des_free(samples);
+    return count;
+}
+
+
+/// <summary>
+/// Finishes all queued work, stops the workers and frees the scheduler.
+/// </summary>
+void scheduler_destroy(scheduler* sched) {
+    scheduler_wait_all(sched);
+    {
+        std::lock_guard<std::mutex> guard(sched->sleep_lock);
+        sched->stopping = 1;
+    }
+    sched->wake.notify_all();
+    for (int i = 0; i < sched->thread_count; i++) {
+        sched->workers[i].thread.join();
+    }
+    delete[] sched->workers;
+    delete sched;
+}
+
+//// -----------------------async part-----------------------
+//
+// C++20 coroutine interface on top of the scheduler. co_await encrypt_async(...) hands the
+// work to the scheduler's workers and suspends; when the job is done the worker posts the
+// coroutine back to its async_executor, so the coroutine always resumes on the thread that
+// runs the executor (an event loop thread, for example) and never on a worker.
+// Only compiled when the compiler supports coroutines.
+
+#if DES_HAS_COROUTINES
+
+#define ASYNC_SEGMENT_BYTES (1 << 20)
+
+
+/// <summary>
+/// Minimal dependency-free executor: a queue of coroutines ready to resume, drained by
+/// executor_run on the calling thread.
+/// </summary>
+typedef struct async_executor {
+    scheduler* pool;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<std::coroutine_handle<>> queue;
+    int live_tasks;
+} async_executor;
+
+
+/// <summary>
+/// Queues a coroutine to be resumed by executor_run. Safe to call from any thread.
+/// </summary>
+void executor_post(async_executor* executor, std::coroutine_handle<> handle) {
+    // notified under the lock: once the handle is visible the executor may finish and be freed
+    std::lock_guard<std::mutex> guard(executor->lock);
+    executor->queue.push_back(handle);
+    executor->ready.notify_one();
+}
+
+
+/// <summary>
+/// Coroutine return type of the async API. A task starts suspended; it runs when it is
+/// awaited by another task or handed to executor_spawn. co_return gives an int status.
+/// </summary>
+struct async_task {
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    /// <summary>
+    /// Resumes the awaiting coroutine, or frees a spawned task that nobody awaits.
+    /// </summary>
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type handle) noexcept {
+            promise_type& promise = handle.promise();
+            if (promise.executor == NULL) {
+                return promise.continuation ? promise.continuation : std::noop_coroutine();
+            }
+            async_executor* executor = promise.executor;
+            handle.destroy();
+            {
+                std::lock_guard<std::mutex> guard(executor->lock);
+                executor->live_tasks--;
+            }
+            executor->ready.notify_all();
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        async_executor* executor = NULL;
+        std::coroutine_handle<> continuation;
+        int result = 0;
+
+        async_task get_return_object() { return async_task(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(int value) { result = value; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit async_task(handle_type handle) : handle(handle) {}
+    async_task(async_task&& other) noexcept : handle(other.handle) { other.handle = NULL; }
+    async_task(const async_task&) = delete;
+    async_task& operator=(const async_task&) = delete;
+    ~async_task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    int await_resume() { return handle.promise().result; }
+
+    handle_type handle;
+};
+
+
+/// <summary>
+/// Starts a task on the executor. The executor owns it from now on and frees it when it ends.
+/// </summary>
+void executor_spawn(async_executor* executor, async_task task) {
+    async_task::handle_type handle = task.handle;
+    task.handle = NULL;
+    handle.promise().executor = executor;
+    {
+        std::lock_guard<std::mutex> guard(executor->lock);
+        executor->live_tasks++;
+    }
+    executor_post(executor, handle);
+}
+
+
+/// <summary>
+/// Resumes ready coroutines on the calling thread until every spawned task has finished.
+/// </summary>
+void executor_run(async_executor* executor) {
+    for (;;) {
+        std::coroutine_handle<> handle;
+        {
+            std::unique_lock<std::mutex> guard(executor->lock);
+            executor->ready.wait(guard, [&] { return !executor->queue.empty() || executor->live_tasks == 0; });
+            if (executor->queue.empty()) {
+                return;
+            }
+            handle = executor->queue.front();
+            executor->queue.pop_front();
+        }
+        handle.resume();
+    }
+}
+
+
+/// <summary>
+/// Creates an executor whose async operations run on the given scheduler.
+/// </summary>
+/// <remarks>Must be released with executor_destroy.</remarks>
+async_executor* executor_create(scheduler* pool) {
+    async_executor* executor = new async_executor();
+    executor->pool = pool;
+    return executor;
+}
+
+
+/// <summary>
+/// Frees an executor. The scheduler is left running.
+/// </summary>
+void executor_destroy(async_executor* executor) {
+    delete executor;
+}
+
+
+/// <summary>
+/// Awaitable for one scheduler job. co_await gives 0 on success and -1 if the job was rejected.
+/// An awaitable created with a non-zero status completes at once with that status.
+/// </summary>
+struct crypt_awaitable {
+    async_executor* executor;
+    crypt_job job;
+    std::coroutine_handle<> waiter;
+    size_t* progress;
+    int status;
+
+    crypt_awaitable(async_executor* executor, const des_key_schedule* schedule, int mode, int decrypt,
+        const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length, size_t* progress, int status)
+        : executor(executor), progress(progress), status(status) {
+        static const unsigned char no_key[BLOCK_BYTES] = { 0 };
+        crypt_job_init(&job, no_key, mode, decrypt, iv, in, out, length);
+        crypt_job_use_schedule(&job, schedule);
+    }
+
+    static void resume_waiter(void* context) {
+        crypt_awaitable* awaitable = (crypt_awaitable*)context;
+        executor_post(awaitable->executor, awaitable->waiter);
+    }
+
+    bool await_ready() { return status != 0; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        waiter = handle;
+        job.on_done = resume_waiter;
+        job.on_done_context = this;
+        status = scheduler_submit(executor->pool, &job);
+        return status == 0;
+    }
+    int await_resume() {
+        if (status == 0 && progress != NULL) {
+            *progress += job.length;
+        }
+        return status;
+    }
+};
+
+
+/// <summary>
+/// Encrypts on the executor's scheduler: co_await encrypt_async(executor, schedule, mode, iv, in, out, length).
+/// </summary>
+/// <param name="executor">Executor the awaiting coroutine runs on</param>
+/// <param name="schedule">Key schedule, copied into the job</param>
+/// <param name="mode">One of the cipher_mode values</param>
+/// <param name="iv">8-byte IV or initial counter, may be NULL for ECB</param>
+/// <param name="in">Input bytes, must stay valid until the await completes</param>
+/// <param name="out">Output bytes, may equal in</param>
+/// <param name="length">Number of bytes, a multiple of 8 for ECB and CBC</param>
+/// <returns>An awaitable giving 0 on success and -1 on invalid parameters</returns>
+crypt_awaitable encrypt_async(async_executor* executor, const des_key_schedule* schedule, int mode, const unsigned char* iv,
+    const unsigned char* in, unsigned char* out, size_t length) {
+    return crypt_awaitable(executor, schedule, mode, 0, iv, in, out, length, NULL, 0);
+}
+
+
+/// <summary>
+/// Decrypts on the executor's scheduler, see encrypt_async.
+/// </summary>
+crypt_awaitable decrypt_async(async_executor* executor, const des_key_schedule* schedule, int mode, const unsigned char* iv,
+    const unsigned char* in, unsigned char* out, size_t length) {
+    return crypt_awaitable(executor, schedule, mode, 1, iv, in, out, length, NULL, 0);
+}
+
+
+/// <summary>
+/// A large operation cut into segments. Every co_await crypt_progress_next(&progress)
+/// processes the next segment and adds it to progress.done, so the caller can write
+/// out[0, done) or read more input between segments. The chain state (CBC and CFB IV, OFB
+/// feedback, CTR counter) is carried between segments. crypt_progress_cancel stops the
+/// operation at the next segment boundary.
+/// </summary>
+typedef struct crypt_progress {
+    async_executor* executor;
+    const des_key_schedule* schedule;
+    int mode;
+    int decrypt;
+    unsigned char chain[BLOCK_BYTES];
+    const unsigned char* in;
+    unsigned char* out;
+    size_t length;
+    size_t segment;
+    size_t submitted;
+    size_t done;
+    int cancelled;
+} crypt_progress;
+
+
+/// <summary>
+/// Prepares a segmented operation.
+/// </summary>
+/// <param name="progress">State to be filled</param>
+/// <param name="segment">Bytes per segment, 0 for ASYNC_SEGMENT_BYTES; rounded down to whole blocks</param>
+/// <remarks>The other parameters are those of encrypt_async.</remarks>
+void crypt_progress_init(crypt_progress* progress, async_executor* executor, const des_key_schedule* schedule, int mode,
+    int decrypt, const unsigned char* iv, const unsigned char* in, unsigned char* out, size_t length, size_t segment) {
+    progress->executor = executor;
+    progress->schedule = schedule;
+    progress->mode = mode;
+    progress->decrypt = decrypt;
+    memset(progress->chain, 0, BLOCK_BYTES);
+    if (iv != NULL) {
+        memcpy(progress->chain, iv, BLOCK_BYTES);
+    }
+    progress->in = in;
+    progress->out = out;
+    progress->length = length;
+    segment = segment == 0 ? ASYNC_SEGMENT_BYTES : segment;
+    progress->segment = segment < BLOCK_BYTES ? BLOCK_BYTES : segment / BLOCK_BYTES * BLOCK_BYTES;
+    progress->submitted = 0;
+    progress->done = 0;
+    progress->cancelled = 0;
+}
+
+
+/// <summary>
+/// Returns non-zero once every segment has been processed or the operation was cancelled.
+/// </summary>
+int crypt_progress_finished(const crypt_progress* progress) {
+    return progress->cancelled || progress->done >= progress->length;
+}
+
+
+/// <summary>
+/// Cancels a segmented operation. A segment already submitted still completes and is
+/// counted in done; every later crypt_progress_next gives -1 without running anything.
+/// Call it on the executor's thread, from the awaiting coroutine or another one.
+/// </summary>
+void crypt_progress_cancel(crypt_progress* progress) {
+    progress->cancelled = 1;
+}
+
+
+/// <summary>
+/// Returns the awaitable for the next segment. Await each segment before asking for the next.
+/// </summary>
+crypt_awaitable crypt_progress_next(crypt_progress* progress) {
+    if (progress->cancelled) {
+        return crypt_awaitable(progress->executor, progress->schedule, progress->mode, progress->decrypt, NULL,
+            progress->in, progress->out, 0, &progress->done, -1);
+    }
+    size_t offset = progress->submitted;
+    size_t length = progress->length - offset < progress->segment ? progress->length - offset : progress->segment;
+    unsigned char iv[BLOCK_BYTES];
+    memcpy(iv, progress->chain, BLOCK_BYTES);
+
+    if (progress->mode == MODE_CTR) {
+        store_be64(progress->chain, load_be64(progress->chain) + length / BLOCK_BYTES);
+    }
+    else if (progress->mode == MODE_OFB) {
+        // the last keystream block of the previous segment is its last output block xor
+        // its last input block, which was saved in chain before the segment ran
+        if (offset > 0) {
+            store_be64(iv, load_be64(progress->chain) ^ load_be64(progress->out + offset - BLOCK_BYTES));
+        }
+        if (length >= BLOCK_BYTES) {
+            memcpy(progress->chain, progress->in + offset + length - BLOCK_BYTES, BLOCK_BYTES);
+        }
+    }
+    else if (progress->mode != MODE_ECB && progress->decrypt) {
+        // taken before the segment runs, the input may be decrypted in place
+        if (length >= BLOCK_BYTES) {
+            memcpy(progress->chain, progress->in + offset + length - BLOCK_BYTES, BLOCK_BYTES);
+        }
+    }
+    else if (progress->mode != MODE_ECB && offset > 0) {
+        // the previous segment has been awaited, its last ciphertext block is the IV
+        memcpy(iv, progress->out + offset - BLOCK_BYTES, BLOCK_BYTES);
+    }
+    progress->submitted += length;
+
+    return crypt_awaitable(progress->executor, progress->schedule, progress->mode, progress->decrypt, iv,
+        progress->in + offset, progress->out + offset, length, &progress->done, 0);
+}
+
+#endif
+
+
+//// -----------------------daemon part-----------------------
+//
+// Long-running encryption service on a Unix domain socket, so short-lived processes do
+// not pay for table and key setup on every run. Key schedules stay hot in a key_cache.
+// Requests arriving within a short window are collected from all clients and processed
+// together: small ECB, CBC and CTR requests go through des_crypt_batch, where requests
+// with the same key share the lanes of the wide kernels; everything else becomes a
+// scheduler job. A payload is either sent inline after the request header or, to avoid
+// copying it through the socket, placed in a memfd whose descriptor is passed with
+// SCM_RIGHTS; the daemon maps it and processes it in place, and so only accepts memfds
+// sealed with F_SEAL_SHRINK. The protocol is local only, so integers are in host byte
+// order. There is no padding: ECB and CBC need whole blocks.
+// One thread serves every client from a ppoll loop. Client sockets are non-blocking and
+// each connection keeps its own receive and send state, so a client that sends slowly or
+// does not read its answers only delays itself. Scheduler jobs report back through an
+// eventfd in the same poll set instead of being waited for, and responses go out per
+// client in request order.
+
+#if DES_HAS_DAEMON
+
+#define DAEMON_MAGIC 0x44455344
+#define DAEMON_FLAG_MEMFD 1
+#define DAEMON_MAX_CLIENTS 256
+#define DAEMON_MAX_BATCH 256
+#define DAEMON_MAX_QUEUED 16
+#define DAEMON_SMALL_BYTES 4096
+#define DAEMON_MAX_INLINE_BYTES (64 << 20)
+#define DAEMON_MEMFD_BYTES 65536
+#define DAEMON_DEFAULT_WINDOW_US 200
+
+
+/// <summary>
+/// Request header sent by a client, followed by the payload unless DAEMON_FLAG_MEMFD is set.
+/// </summary>
+typedef struct daemon_request {
+    uint32_t magic;
+    uint8_t decrypt;
+    uint8_t mode;
+    uint8_t flags;
+    uint8_t reserved;
+    unsigned char key[BLOCK_BYTES];
+    unsigned char iv[BLOCK_BYTES];
+    uint64_t length;
+} daemon_request;
+
+
+/// <summary>
+/// Response header, followed by the processed payload for inline requests.
+/// </summary>
+typedef struct daemon_response {
+    uint32_t magic;
+    int32_t status;
+    uint64_t length;
+} daemon_response;
+
+
+/// <summary>
+/// A request, from its complete header until its response has been sent.
+/// </summary>
+typedef struct daemon_pending {
+    struct daemon_connection* connection;
+    struct daemon_state* daemon;
+    daemon_request header;
+    unsigned char* data;
+    int memfd;
+    int status;
+    int done;
+    des_key_schedule schedule;
+    crypt_job job;
+} daemon_pending;
+
+
+/// <summary>
+/// A connected client. Its socket is non-blocking in both directions: a request is taken
+/// in as its bytes arrive, and responses go out in request order as far as the socket
+/// accepts them, so a slow client never holds up the others.
+/// </summary>
+typedef struct daemon_connection {
+    int fd;
+    int broken;
+    daemon_request header;
+    size_t header_received;
+    int memfd;
+    daemon_pending* receiving;
+    size_t payload_received;
+    std::deque<daemon_pending*> answers;
+    daemon_response response;
+    size_t answer_sent;
+} daemon_connection;
+
+
+/// <summary>
+/// State of a running daemon. fds[0] is the listener and fds[1] the eventfd that scheduler
+/// workers signal when a job has finished; clients follow, with connections[] in step.
+/// </summary>
+typedef struct daemon_state {
+    int listener;
+    int events;
+    int window_us;
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 2];
+    daemon_connection* connections[DAEMON_MAX_CLIENTS + 2];
+    int fd_count;
+    daemon_pending* batch[DAEMON_MAX_BATCH];
+    int batch_count;
+    std::chrono::steady_clock::time_point deadline;
+    key_cache* keys;
+    scheduler* pool;
+    std::mutex finished_lock;
+    std::deque<daemon_pending*> finished;
+} daemon_state;
+
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+
+/// <summary>
+/// Signal handler asking the daemon loop to finish.
+/// </summary>
+static void daemon_signal(int signal_number) {
+    (void)signal_number;
+    daemon_stop = 1;
+}
+
+
+/// <summary>
+/// Reads exactly length bytes from a socket.
+/// </summary>
+/// <returns>0 on success, -1 on error or end of stream</returns>
+static int read_full(int fd, void* buffer, size_t length) {
+    unsigned char* p = (unsigned char*)buffer;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Writes exactly length bytes to a socket, without raising SIGPIPE.
+/// </summary>
+/// <returns>0 on success, -1 on error</returns>
+static int write_full(int fd, const void* buffer, size_t length) {
+    const unsigned char* p = (const unsigned char*)buffer;
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Receives as much of the current request header as has arrived, keeping a descriptor
+/// passed with it. Never blocks.
+/// </summary>
+/// <returns>Bytes received, 0 at end of stream, -1 on error (errno is EAGAIN if nothing is there yet)</returns>
+static ssize_t daemon_receive_header(daemon_connection* connection) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec vector = { (unsigned char*)&connection->header + connection->header_received,
+        sizeof(daemon_request) - connection->header_received };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(connection->fd, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n <= 0) {
+        return n;
+    }
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&message); c != NULL; c = CMSG_NXTHDR(&message, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            // one descriptor per header; a client sending more only loses the earlier ones
+            if (connection->memfd >= 0) {
+                close(connection->memfd);
+            }
+            memcpy(&connection->memfd, CMSG_DATA(c), sizeof(int));
+        }
+    }
+    return n;
+}
+
+
+/// <summary>
+/// Sends a request header, passing a descriptor along with it when memfd is not -1.
+/// </summary>
+/// <returns>0 on success, -1 on error</returns>
+static int daemon_send_header(int fd, const daemon_request* header, int memfd) {
+    if (memfd < 0) {
+        return write_full(fd, header, sizeof(*header));
+    }
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec vector = { (void*)header, sizeof(*header) };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &memfd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return -1;
+    }
+    return write_full(fd, (const unsigned char*)header + n, sizeof(*header) - n);
+}
+
+
+/// <summary>
+/// Releases a request's payload and the request itself.
+/// </summary>
+static void daemon_release(daemon_pending* request) {
+    size_t length = (size_t)request->header.length;
+    if (request->memfd >= 0) {
+        if (request->data != NULL && length > 0) {
+            munmap(request->data, length);
+        }
+        close(request->memfd);
+    }
+    else {
+        des_free(request->data);
+    }
+    delete request;
+}
+
+
+/// <summary>
+/// Sends the finished responses at the front of a client's queue until the socket would
+/// block or the next request is still being processed. Sent requests are released.
+/// </summary>
+/// <returns>0 on success, -1 if the client has to be disconnected</returns>
+static int daemon_send_answers(daemon_connection* connection) {
+    while (!connection->answers.empty() && connection->answers.front()->done) {
+        daemon_pending* request = connection->answers.front();
+        size_t length = request->status == 0 && request->memfd < 0 ? (size_t)request->header.length : 0;
+        if (connection->answer_sent == 0) {
+            connection->response.magic = DAEMON_MAGIC;
+            connection->response.status = request->status;
+            connection->response.length = request->status == 0 ? request->header.length : 0;
+        }
+        while (connection->answer_sent < sizeof(daemon_response) + length) {
+            struct iovec vectors[2];
+            int count = 0;
+            size_t offset = connection->answer_sent;
+            if (offset < sizeof(daemon_response)) {
+                vectors[count].iov_base = (unsigned char*)&connection->response + offset;
+                vectors[count++].iov_len = sizeof(daemon_response) - offset;
+                offset = 0;
+            }
+            else {
+                offset -= sizeof(daemon_response);
+            }
+            if (length > 0) {
+                vectors[count].iov_base = request->data + offset;
+                vectors[count++].iov_len = length - offset;
+            }
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = vectors;
+            message.msg_iovlen = count;
+            ssize_t n = sendmsg(connection->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            if (n <= 0) {
+                return -1;
+            }
+            connection->answer_sent += (size_t)n;
+        }
+        connection->answers.pop_front();
+        connection->answer_sent = 0;
+        daemon_release(request);
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Marks a request as processed and sends what its client can receive now. Requests of
+/// clients that have gone away are released.
+/// </summary>
+static void daemon_finish(daemon_pending* request) {
+    request->done = 1;
+    if (request->connection == NULL) {
+        daemon_release(request);
+    }
+    else if (daemon_send_answers(request->connection) != 0) {
+        request->connection->broken = 1;
+    }
+}
+
+
+/// <summary>
+/// on_done callback of a scheduler job, called on a worker thread: hands the request back
+/// to the daemon loop and wakes it through the eventfd.
+/// </summary>
+static void daemon_job_done(void* context) {
+    daemon_pending* request = (daemon_pending*)context;
+    daemon_state* daemon = request->daemon;
+    {
+        std::lock_guard<std::mutex> guard(daemon->finished_lock);
+        daemon->finished.push_back(request);
+    }
+    eventfd_write(daemon->events, 1);
+}
+
+
+/// <summary>
+/// Answers the requests whose scheduler jobs have finished.
+/// </summary>
+static void daemon_collect_finished(daemon_state* daemon) {
+    eventfd_t signals;
+    eventfd_read(daemon->events, &signals);
+    std::deque<daemon_pending*> finished;
+    {
+        std::lock_guard<std::mutex> guard(daemon->finished_lock);
+        finished.swap(daemon->finished);
+    }
+    for (size_t i = 0; i < finished.size(); i++) {
+        daemon_finish(finished[i]);
+    }
+}
+
+
+/// <summary>
+/// Returns non-zero for requests that go through des_crypt_batch rather than the scheduler.
+/// </summary>
+static int daemon_batchable(const daemon_pending* request) {
+    return request->header.mode <= MODE_CTR && request->header.length <= DAEMON_SMALL_BYTES;
+}
+
+
+/// <summary>
+/// Processes every request of the current batch. Small requests are done and answered
+/// right away; the others are handed to the scheduler, whose workers report them through
+/// daemon_job_done, so the loop never waits for them.
+/// </summary>
+static void daemon_flush(daemon_state* daemon) {
+    int count = daemon->batch_count;
+    daemon_pending** pending = daemon->batch;
+    daemon->batch_count = 0;
+
+    // requests with equal keys share one schedule pointer, which is what des_crypt_batch groups by;
+    // the distinct keys are looked up together, so the new ones are built in one bulk setup
+    const des_key_schedule* schedules[DAEMON_MAX_BATCH];
+    const unsigned char* distinct_keys[DAEMON_MAX_BATCH];
+    des_key_schedule* distinct_schedules[DAEMON_MAX_BATCH];
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        schedules[i] = &pending[i]->schedule;
+        for (int j = 0; j < i; j++) {
+            if (memcmp(pending[j]->header.key, pending[i]->header.key, BLOCK_BYTES) == 0) {
+                schedules[i] = schedules[j];
+                break;
+            }
+        }
+        if (schedules[i] == &pending[i]->schedule) {
+            distinct_keys[distinct] = pending[i]->header.key;
+            distinct_schedules[distinct++] = &pending[i]->schedule;
+        }
+    }
+    key_cache_lookup_many(daemon->keys, distinct_keys, distinct, distinct_schedules);
+
+    crypt_request requests[DAEMON_MAX_BATCH];
+    daemon_pending* owners[DAEMON_MAX_BATCH];
+    for (int mode = MODE_ECB; mode <= MODE_CTR; mode++) {
+        for (int decrypt = 0; decrypt < 2; decrypt++) {
+            int n = 0;
+            for (int i = 0; i < count; i++) {
+                daemon_pending* request = pending[i];
+                if (daemon_batchable(request) && request->header.mode == mode && request->header.decrypt == decrypt) {
+                    requests[n].schedule = schedules[i];
+                    requests[n].iv = request->header.iv;
+                    requests[n].in = request->data;
+                    requests[n].out = request->data;
+                    requests[n].length = (size_t)request->header.length;
+                    owners[n++] = request;
+                }
+            }
+            if (n > 0 && des_crypt_batch(requests, n, mode, decrypt) != 0) {
+                for (int i = 0; i < n; i++) {
+                    owners[i]->status = -1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        daemon_pending* request = pending[i];
+        if (daemon_batchable(request)) {
+            continue;
+        }
+        crypt_job_init(&request->job, request->header.key, request->header.mode, request->header.decrypt, request->header.iv,
+            request->data, request->data, (size_t)request->header.length);
+        crypt_job_use_schedule(&request->job, schedules[i]);
+        request->job.on_done = daemon_job_done;
+        request->job.on_done_context = request;
+        if (scheduler_submit(daemon->pool, &request->job) != 0) {
+            request->status = -1;
+        }
+    }
+
+    // only now, because finishing may release a request whose schedule others point at
+    for (int i = 0; i < count; i++) {
+        if (daemon_batchable(pending[i]) || pending[i]->status != 0) {
+            daemon_finish(pending[i]);
+        }
+    }
+}
+
+
+/// <summary>
+/// Queues a completely received request on its client and checks it. Valid requests join
+/// the current batch, invalid ones are answered with status -1.
+/// </summary>
+static void daemon_queue_request(daemon_state* daemon, daemon_pending* request) {
+    daemon_request* header = &request->header;
+    size_t length = (size_t)header->length;
+    request->connection->answers.push_back(request);
+    if (header->decrypt > 1 || header->mode > MODE_CFB8 || (header->mode <= MODE_CBC && length % BLOCK_BYTES != 0)
+        || (request->data == NULL && length > 0)) {
+        daemon_finish(request);
+        return;
+    }
+    request->status = 0;
+    if (daemon->batch_count == 0) {
+        daemon->deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(daemon->window_us);
+    }
+    daemon->batch[daemon->batch_count++] = request;
+    if (daemon->batch_count == DAEMON_MAX_BATCH) {
+        daemon_flush(daemon);
+    }
+}
+
+
+/// <summary>
+/// Starts a request once its header is complete: maps a passed memfd, or allocates the
+/// buffer an inline payload is received into.
+/// </summary>
+/// <returns>0 on success, -1 if the client has to be disconnected</returns>
+static int daemon_start_request(daemon_state* daemon, daemon_connection* connection) {
+    daemon_request* header = &connection->header;
+    size_t length = (size_t)header->length;
+    int shared = (header->flags & DAEMON_FLAG_MEMFD) != 0;
+    int memfd = connection->memfd;
+    connection->memfd = -1;
+    connection->header_received = 0;
+    if (header->magic != DAEMON_MAGIC || shared != (memfd >= 0) || (!shared && length > DAEMON_MAX_INLINE_BYTES)) {
+        // the stream can not be resynchronized after a bad header
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return -1;
+    }
+
+    daemon_pending* request = new daemon_pending();
+    request->connection = connection;
+    request->daemon = daemon;
+    request->header = *header;
+    request->data = NULL;
+    request->memfd = memfd;
+    request->status = -1;
+    request->done = 0;
+    if (shared) {
+        // a client could shrink an unsealed file under the mapping and kill the daemon with
+        // SIGBUS, so only memfds sealed against shrinking are mapped
+        int seals = fcntl(memfd, F_GET_SEALS);
+        struct stat info;
+        if (length > 0 && seals >= 0 && (seals & F_SEAL_SHRINK) != 0 && fstat(memfd, &info) == 0
+            && (uint64_t)info.st_size >= header->length) {
+            void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+            request->data = mapping == MAP_FAILED ? NULL : (unsigned char*)mapping;
+        }
+    }
+    else {
+        request->data = (unsigned char*)des_malloc(length > 0 ? length : 1);
+        if (request->data == NULL) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            daemon_release(request);
+            return -1;
+        }
+        if (length > 0) {
+            connection->receiving = request;
+            connection->payload_received = 0;
+            return 0;
+        }
+    }
+    daemon_queue_request(daemon, request);
+    return 0;
+}
+
+
+/// <summary>
+/// Takes in whatever a client has sent, without blocking, and starts the requests it
+/// completes. Stops while the client has DAEMON_MAX_QUEUED requests unanswered.
+/// </summary>
+/// <returns>0 on success, -1 if the client has to be disconnected</returns>
+static int daemon_receive(daemon_state* daemon, daemon_connection* connection) {
+    while (connection->answers.size() < DAEMON_MAX_QUEUED) {
+        ssize_t n;
+        if (connection->receiving != NULL) {
+            daemon_pending* request = connection->receiving;
+            size_t length = (size_t)request->header.length;
+            n = read(connection->fd, request->data + connection->payload_received, length - connection->payload_received);
+            if (n > 0 && (connection->payload_received += (size_t)n) == length) {
+                connection->receiving = NULL;
+                daemon_queue_request(daemon, request);
+            }
+        }
+        else {
+            n = daemon_receive_header(connection);
+            if (n > 0 && (connection->header_received += (size_t)n) == sizeof(daemon_request)
+                && daemon_start_request(daemon, connection) != 0) {
+                return -1;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Closes a client connection. Its requests still in the batch or the scheduler are
+/// finished, then released without an answer.
+/// </summary>
+static void daemon_disconnect(daemon_state* daemon, int index) {
+    daemon_connection* connection = daemon->connections[index];
+    for (size_t i = 0; i < connection->answers.size(); i++) {
+        daemon_pending* request = connection->answers[i];
+        if (request->done) {
+            daemon_release(request);
+        }
+        else {
+            request->connection = NULL;
+        }
+    }
+    if (connection->receiving != NULL) {
+        daemon_release(connection->receiving);
+    }
+    if (connection->memfd >= 0) {
+        close(connection->memfd);
+    }
+    close(connection->fd);
+    delete connection;
+    daemon->fd_count--;
+    daemon->fds[index] = daemon->fds[daemon->fd_count];
+    daemon->connections[index] = daemon->connections[daemon->fd_count];
+}
+
+
+/// <summary>
+/// Clears the socket path before binding. Only a socket no daemon answers on is removed.
+/// </summary>
+/// <returns>0 if the path is free, -1 if it holds another file or a live daemon</returns>
+static int daemon_remove_stale_socket(const struct sockaddr_un* address) {
+    struct stat info;
+    if (lstat(address->sun_path, &info) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(info.st_mode)) {
+        fprintf(stderr, "%s exists and is not a socket.\n", address->sun_path);
+        return -1;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return -1;
+    }
+    int answered = connect(probe, (const struct sockaddr*)address, sizeof(*address)) == 0;
+    int stale = !answered && errno == ECONNREFUSED;
+    close(probe);
+    if (answered) {
+        fprintf(stderr, "A daemon is already listening on %s.\n", address->sun_path);
+        return -1;
+    }
+    if (!stale) {
+        fprintf(stderr, "Cannot tell whether %s is in use.\n", address->sun_path);
+        return -1;
+    }
+    return unlink(address->sun_path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+
+/// <summary>
+/// Removes the socket file, unless another process has replaced it since it was bound.
+/// </summary>
+static void daemon_remove_own_socket(const char* path, const struct stat* bound) {
+    struct stat info;
+    if (lstat(path, &info) == 0 && info.st_dev == bound->st_dev && info.st_ino == bound->st_ino) {
+        unlink(path);
+    }
+}
+
+
+/// <summary>
+/// Runs the daemon until SIGINT or SIGTERM.
+/// </summary>
+/// <param name="path">Path of the Unix domain socket; a stale socket there is replaced, anything else is left alone</param>
+/// <param name="window_us">Batching window in microseconds, measured from the first queued request</param>
+/// <param name="threads">Scheduler threads for large requests, 0 for one per hardware thread</param>
+/// <returns>0 on a clean shutdown, 1 on failure</returns>
+int run_daemon(const char* path, int window_us, int threads) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long.\n");
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    if (daemon_remove_stale_socket(&address) != 0) {
+        return 1;
+    }
+    struct stat bound;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Cannot listen on %s.\n", path);
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+    if (lstat(path, &bound) != 0 || listen(listener, 64) != 0) {
+        fprintf(stderr, "Cannot listen on %s.\n", path);
+        close(listener);
+        return 1;
+    }
+    int events = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (events < 0) {
+        fprintf(stderr, "Cannot create an eventfd.\n");
+        close(listener);
+        daemon_remove_own_socket(path, &bound);
+        return 1;
+    }
+
+    daemon_state* daemon = new daemon_state();
+    daemon->listener = listener;
+    daemon->events = events;
+    daemon->window_us = window_us;
+    daemon->fds[0].fd = listener;
+    daemon->fds[1].fd = events;
+    daemon->connections[0] = NULL;
+    daemon->connections[1] = NULL;
+    daemon->fd_count = 2;
+    daemon->batch_count = 0;
+    daemon->keys = new key_cache();
+    // SIGINT and SIGTERM stay blocked except inside ppoll, so a stop request can neither
+    // land on a scheduler worker (they inherit the mask) nor slip in between the check of
+    // daemon_stop and the wait
+    sigset_t stop_signals;
+    sigset_t unblocked;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &unblocked);
+    daemon->pool = scheduler_create(threads);
+    daemon_stop = 0;
+    struct sigaction action;
+    struct sigaction previous_int;
+    struct sigaction previous_term;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = daemon_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous_int);
+    sigaction(SIGTERM, &action, &previous_term);
+    printf("Listening on %s, batching window %d us.\n", path, window_us);
+    fflush(stdout);
+
+    int status = 0;
+    while (!daemon_stop) {
+        struct timespec timeout;
+        struct timespec* wait = NULL;
+        if (daemon->batch_count > 0) {
+            long long left = std::chrono::duration_cast<std::chrono::nanoseconds>(daemon->deadline - std::chrono::steady_clock::now()).count();
+            left = left > 0 ? left : 0;
+            timeout.tv_sec = (time_t)(left / 1000000000);
+            timeout.tv_nsec = (long)(left % 1000000000);
+            wait = &timeout;
+        }
+        for (int i = 0; i < daemon->fd_count; i++) {
+            daemon_connection* connection = daemon->connections[i];
+            daemon->fds[i].events = POLLIN;
+            daemon->fds[i].revents = 0;
+            if (connection != NULL) {
+                // a client that does not read its answers is not read from either
+                daemon->fds[i].events = connection->answers.size() < DAEMON_MAX_QUEUED ? POLLIN : 0;
+                if (!connection->answers.empty() && connection->answers.front()->done) {
+                    daemon->fds[i].events |= POLLOUT;
+                }
+            }
+        }
+        int ready = ppoll(daemon->fds, daemon->fd_count, wait, &unblocked);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed.\n");
+            status = 1;
+            break;
+        }
+        if (ready > 0 && (daemon->fds[1].revents & POLLIN) != 0) {
+            daemon_collect_finished(daemon);
+        }
+        for (int i = 2; ready > 0 && i < daemon->fd_count; i++) {
+            daemon_connection* connection = daemon->connections[i];
+            short revents = daemon->fds[i].revents;
+            if ((revents & (POLLHUP | POLLERR)) != 0) {
+                // the peer is gone, so nothing it still sends could be answered
+                connection->broken = 1;
+            }
+            if (!connection->broken && (revents & POLLOUT) != 0 && daemon_send_answers(connection) != 0) {
+                connection->broken = 1;
+            }
+            if (!connection->broken && (revents & POLLIN) != 0 && daemon_receive(daemon, connection) != 0) {
+                connection->broken = 1;
+            }
+        }
+        if (daemon->batch_count > 0 && std::chrono::steady_clock::now() >= daemon->deadline) {
+            daemon_flush(daemon);
+        }
+        // backwards, because a disconnect moves the last client into the freed slot
+        for (int i = daemon->fd_count - 1; i >= 2; i--) {
+            if (daemon->connections[i]->broken) {
+                daemon_disconnect(daemon, i);
+            }
+        }
+        if (ready > 0 && (daemon->fds[0].revents & POLLIN) != 0) {
+            int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client >= 0 && daemon->fd_count < DAEMON_MAX_CLIENTS + 2) {
+                daemon_connection* connection = new daemon_connection();
+                connection->fd = client;
+                connection->memfd = -1;
+                daemon->connections[daemon->fd_count] = connection;
+                daemon->fds[daemon->fd_count++].fd = client;
+            }
+            else if (client >= 0) {
+                close(client);
+            }
+        }
+    }
+
+    // on the way out the loop may wait: what is queued or running is finished, and each
+    // client gets what its socket takes without blocking
+    daemon_flush(daemon);
+    scheduler_wait_all(daemon->pool);
+    daemon_collect_finished(daemon);
+    while (daemon->fd_count > 2) {
+        daemon_disconnect(daemon, daemon->fd_count - 1);
+    }
+    close(events);
+    close(listener);
+    daemon_remove_own_socket(path, &bound);
+    scheduler_destroy(daemon->pool);
+    delete daemon->keys;
+    delete daemon;
+    sigaction(SIGINT, &previous_int, NULL);
+    sigaction(SIGTERM, &previous_term, NULL);
+    pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+    return status;
+}
+
+
+/// <summary>
+/// Connects to a running daemon.
+/// </summary>
+/// <returns>The connected socket, or -1 on failure</returns>
+int daemon_connect(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+
+/// <summary>
+/// Allocates a buffer in a memfd, so the daemon can process it without a socket copy.
+/// The memfd is sealed at its size, as the daemon requires.
+/// </summary>
+/// <param name="length">Buffer size in bytes, at least 1</param>
+/// <param name="memfd">Receives the memfd to pass to daemon_client_crypt</param>
+/// <returns>The mapped buffer, or NULL on failure</returns>
+unsigned char* daemon_shared_alloc(size_t length, int* memfd) {
+    *memfd = memfd_create("des-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*memfd < 0) {
+        return NULL;
+    }
+    void* mapping = MAP_FAILED;
+    if (ftruncate(*memfd, (off_t)length) == 0 && fcntl(*memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == 0) {
+        mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, *memfd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        close(*memfd);
+        *memfd = -1;
+        return NULL;
+    }
+    return (unsigned char*)mapping;
+}
+
+
+/// <summary>
+/// Releases a buffer from daemon_shared_alloc.
+/// </summary>
+void daemon_shared_free(unsigned char* buffer, size_t length, int memfd) {
+    if (buffer != NULL) {
+        munmap(buffer, length);
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+}
+
+
+/// <summary>
+/// Has the daemon encrypt or decrypt a buffer in place and waits for the result.
+/// </summary>
+/// <param name="connection">Socket from daemon_connect</param>
+/// <param name="decrypt">Non-zero to decrypt</param>
+/// <param name="mode">One of the cipher_mode values</param>
+/// <param name="key">8-byte key</param>
+/// <param name="iv">8-byte IV, or initial counter for CTR; may be NULL for ECB</param>
+/// <param name="buffer">Data, replaced by the result</param>
+/// <param name="length">Number of bytes, a multiple of 8 for ECB and CBC</param>
+/// <param name="memfd">memfd holding buffer (see daemon_shared_alloc), or -1 to send the data through the socket</param>
+/// <returns>0 on success, -1 on failure</returns>
+int daemon_client_crypt(int connection, int decrypt, int mode, const unsigned char* key, const unsigned char* iv,
+    unsigned char* buffer, size_t length, int memfd) {
+    daemon_request header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DAEMON_MAGIC;
+    header.decrypt = (uint8_t)(decrypt != 0);
+    header.mode = (uint8_t)mode;
+    header.flags = memfd >= 0 ? DAEMON_FLAG_MEMFD : 0;
+    memcpy(header.key, key, BLOCK_BYTES);
+    if (iv != NULL) {
+        memcpy(header.iv, iv, BLOCK_BYTES);
+    }
+    header.length = length;
+
+    daemon_response response;
+    if (daemon_send_header(connection, &header, memfd) != 0 || (memfd < 0 && write_full(connection, buffer, length) != 0)
+        || read_full(connection, &response, sizeof(response)) != 0 || response.magic != DAEMON_MAGIC) {
+        return -1;
+    }
+    if (response.status != 0) {
+        return -1;
+    }
+    if (response.length != length || (memfd < 0 && read_full(connection, buffer, length) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Sends stdin to a running daemon and writes the result to stdout. Inputs of at least
+/// DAEMON_MEMFD_BYTES travel in a memfd.
+/// </summary>
+/// <returns>Process exit code</returns>
+int run_daemon_filter(const char* path, int decrypt, int mode, const unsigned char* key, const unsigned char* iv) {
+    size_t length = 0, allocated = 65536;
+    unsigned char* data = (unsigned char*)des_malloc(allocated);
+    while (data != NULL) {
+        length += fread(data + length, 1, allocated - length, stdin);
+        if (length < allocated) {
+            break;
+        }
+        allocated *= 2;
+        unsigned char* grown = (unsigned char*)des_realloc(data, allocated);
+        if (grown == NULL) {
+            des_free(data);
+        }
+        data = grown;
+    }
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+
+    int connection = daemon_connect(path);
+    if (connection < 0) {
+        fprintf(stderr, "Cannot connect to %s.\n", path);
+        des_free(data);
+        return 1;
+    }
+    int memfd = -1;
+    unsigned char* buffer = data;
+    if (length >= DAEMON_MEMFD_BYTES) {
+        buffer = daemon_shared_alloc(length, &memfd);
+        if (buffer == NULL) {
+            buffer = data;
+        }
+        else {
+            memcpy(buffer, data, length);
+        }
+    }
+    int status = daemon_client_crypt(connection, decrypt, mode, key, iv, buffer, length, memfd);
+    if (status != 0) {
+        fprintf(stderr, "The daemon rejected the request.\n");
+    }
+    else if (fwrite(buffer, 1, length, stdout) != length || fflush(stdout) != 0) {
+        fprintf(stderr, "Failed to write output.\n");
+        status = -1;
+    }
+    if (buffer != data) {
+        daemon_shared_free(buffer, length, memfd);
+    }
+    close(connection);
+    des_free(data);
+    return status == 0 ? 0 : 1;
+}
+
+#endif
+
+
+//// -----------------------scaling benchmark part-----------------------
+//
+// Runs the parallel modes (ECB, CTR, CBC decryption) at 1..N threads under a pinning policy:
+//   compact : thread i on the i-th CPU, filling one NUMA node before the next
+//   scatter : threads dealt round-robin over the nodes, one CPU each
+//   numa    : threads split evenly over the nodes, each allowed on every CPU of its node
+// Every worker allocates and first touches its own slice after pinning, so the slice lives
+// on the worker's node. An in-place streaming pass over the same slices gives the memory
+// bandwidth ceiling for each thread count.
+
+#define BENCH_POLICY_COMPACT 0
+#define BENCH_POLICY_SCATTER 1
+#define BENCH_POLICY_NUMA 2
+#define BENCH_MAX_CPUS 1024
+#define BENCH_KERNELS 4
+
+static const char* bench_policy_names[3] = { "compact", "scatter", "numa" };
+static const char* bench_kernel_names[BENCH_KERNELS] = { "ECB", "CTR", "CBC-dec", "memory" };
+
+
+/// <summary>
+/// CPUs available to the process, ordered by NUMA node and then by CPU number.
+/// </summary>
+typedef struct cpu_topology {
+    int cpu_count;
+    int node_count;
+    int cpus[BENCH_MAX_CPUS];
+    int nodes[BENCH_MAX_CPUS];
+} cpu_topology;
+
+
+/// <summary>
+/// Reads the CPU and NUMA layout. On Linux the nodes come from sysfs; elsewhere, or when
+/// sysfs has no node information, every CPU is put in node 0.
+/// </summary>
+void load_cpu_topology(cpu_topology* topology) {
+    topology->cpu_count = 0;
+    topology->node_count = 0;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int node = 0; node < 256 && topology->cpu_count < BENCH_MAX_CPUS; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        int found = 0, first, last;
+        while (fscanf(file, "%d", &first) == 1) {
+            last = first;
+            int c = fgetc(file);
+            if (c == '-') {
+                if (fscanf(file, "%d", &last) != 1) {
+                    break;
+                }
+                c = fgetc(file);
+            }
+            for (int cpu = first; cpu <= last && topology->cpu_count < BENCH_MAX_CPUS; cpu++) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    topology->cpus[topology->cpu_count] = cpu;
+                    topology->nodes[topology->cpu_count++] = topology->node_count;
+                    found = 1;
+                }
+            }
+            if (c != ',') {
+                break;
+            }
+        }
+        fclose(file);
+        topology->node_count += found;
+    }
+    if (topology->cpu_count == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && topology->cpu_count < BENCH_MAX_CPUS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                topology->cpus[topology->cpu_count] = cpu;
+                topology->nodes[topology->cpu_count++] = 0;
+            }
+        }
+    }
+#endif
+    if (topology->cpu_count == 0) {
+        int count = (int)std::thread::hardware_concurrency();
+        for (int cpu = 0; cpu < (count > 0 ? count : 1) && cpu < BENCH_MAX_CPUS; cpu++) {
+            topology->cpus[topology->cpu_count] = cpu;
+            topology->nodes[topology->cpu_count++] = 0;
+        }
+    }
+    if (topology->node_count == 0) {
+        topology->node_count = 1;
+    }
+}
+
+
+/// <summary>
+/// Restricts the calling thread to the given CPUs. Does nothing where affinity is not supported.
+/// </summary>
+/// <returns>0 on success, -1 on failure</returns>
+int pin_current_thread(const int* cpus, int count) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < count; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+#elif defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (int i = 0; i < count; i++) {
+        if (cpus[i] < (int)(8 * sizeof(DWORD_PTR))) {
+            mask |= (DWORD_PTR)1 << cpus[i];
+        }
+    }
+    return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0 ? 0 : -1;
+#else
+    (void)cpus;
+    (void)count;
+    return 0;
+#endif
+}
+
+
+/// <summary>
+/// Chooses the CPUs a benchmark thread may run on under a pinning policy.
+/// </summary>
+/// <param name="topology">CPU layout</param>
+/// <param name="policy">BENCH_POLICY_COMPACT, BENCH_POLICY_SCATTER or BENCH_POLICY_NUMA</param>
+/// <param name="thread">Index of the thread</param>
+/// <param name="threads">Number of threads</param>
+/// <param name="cpus">Receives the CPU numbers</param>
+/// <returns>Number of CPUs written</returns>
+static int bench_thread_cpus(const cpu_topology* topology, int policy, int thread, int threads, int* cpus) {
+    if (policy == BENCH_POLICY_COMPACT) {
+        cpus[0] = topology->cpus[thread % topology->cpu_count];
+        return 1;
+    }
+
+    int node = policy == BENCH_POLICY_SCATTER ? thread % topology->node_count : thread * topology->node_count / threads;
+    int count = 0;
+    for (int i = 0; i < topology->cpu_count; i++) {
+        if (topology->nodes[i] == node) {
+            cpus[count++] = topology->cpus[i];
+        }
+    }
+    if (policy == BENCH_POLICY_SCATTER) {
+        cpus[0] = cpus[(thread / topology->node_count) % count];
+        count = 1;
+    }
+    return count;
+}
+
+
+/// <summary>
+/// Shared state of one measured run.
+/// </summary>
+typedef struct bench_run {
+    const cpu_topology* topology;
+    const des_key_schedule* schedule;
+    int policy;
+    int kernel;
+    int threads;
+    size_t slice_bytes;
+    std::atomic<int> ready;
+    std::atomic<int> go;
+    int failed;
+} bench_run;
+
+
+/// <summary>
+/// Processes a buffer with one of the benchmark kernels.
+/// </summary>
+static void bench_kernel(int kernel, const des_key_schedule* schedule, unsigned char* buffer, size_t bytes) {
+    static const unsigned char iv[BLOCK_BYTES] = { 0 };
+    if (kernel == 0) {
+        des_ecb_crypt(schedule, buffer, buffer, bytes / BLOCK_BYTES, 0);
+    }
+    else if (kernel == 1) {
+        des_ctr_crypt(schedule, 0, buffer, buffer, bytes);
+    }
+    else if (kernel == 2) {
+        des_cbc_decrypt(schedule, iv, buffer, buffer, bytes / BLOCK_BYTES);
+    }
+    else {
+        uint64_t* words = (uint64_t*)buffer;
+        for (size_t i = 0; i < bytes / sizeof(uint64_t); i++) {
+            words[i] ^= 0x5A5A5A5A5A5A5A5AULL;
+        }
+    }
+}
+
+
+/// <summary>
+/// Benchmark thread: pins itself, first touches its slice, waits for the start signal and
+/// runs the kernel over its slice.
+/// </summary>
+static void bench_worker(bench_run* run, int thread) {
+    int cpus[BENCH_MAX_CPUS];
+    int count = bench_thread_cpus(run->topology, run->policy, thread, run->threads, cpus);
+    pin_current_thread(cpus, count);
+
+    unsigned char* slice = (unsigned char*)des_malloc(run->slice_bytes);
+    if (slice == NULL) {
+        run->failed = 1;
+    }
+    else {
+        memset(slice, thread, run->slice_bytes);
+    }
+    run->ready++;
+    while (!run->go) {
+        std::this_thread::yield();
+    }
+    if (slice != NULL) {
+        bench_kernel(run->kernel, run->schedule, slice, run->slice_bytes);
+    }
+    des_free(slice);
+}
+
+
+/// <summary>
+/// Measures one kernel at one thread count.
+/// </summary>
+/// <returns>Throughput in MB/s, or a negative value on failure</returns>
+double bench_measure(const cpu_topology* topology, const des_key_schedule* schedule, int policy, int kernel,
+    int threads, size_t total_bytes) {
+    bench_run* run = new bench_run();
+    run->topology = topology;
+    run->schedule = schedule;
+    run->policy = policy;
+    run->kernel = kernel;
+    run->threads = threads;
+    run->slice_bytes = total_bytes / threads / BLOCK_BYTES * BLOCK_BYTES;
+
+    std::thread* workers = new std::thread[threads];
+    for (int t = 0; t < threads; t++) {
+        workers[t] = std::thread(bench_worker, run, t);
+    }
+    while (run->ready < threads) {
+        std::this_thread::yield();
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    run->go = 1;
+    for (int t = 0; t < threads; t++) {
+        workers[t].join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double throughput = run->failed ? -1 : (double)run->slice_bytes * threads / seconds / 1e6;
+    delete[] workers;
+    delete run;
+    return throughput;
+}
+
+
+/// <summary>
+/// Runs the scaling benchmark and prints throughput, parallel efficiency and the memory
+/// bandwidth ceiling for every mode, policy and thread count.
+/// </summary>
+/// <param name="max_threads">Highest thread count, 0 for one per available CPU</param>
+/// <param name="policy">Pinning policy, or -1 for all of them</param>
+/// <param name="total_bytes">Bytes processed per measurement, split between the threads</param>
+/// <returns>0 on success, 1 on failure</returns>
+int run_scaling_benchmark(int max_threads, int policy, size_t total_bytes) {
+    cpu_topology* topology = (cpu_topology*)des_malloc(sizeof(cpu_topology));
+    if (topology == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+    load_cpu_topology(topology);
+    if (max_threads <= 0) {
+        max_threads = topology->cpu_count;
+    }
+    des_key_schedule schedule;
+    fixture_setup(&schedule, NULL, 0);
+
+    printf("%d CPUs in %d NUMA nodes, %zu MiB per measurement\n", topology->cpu_count, topology->node_count, total_bytes >> 20);
+    printf("%-8s %-8s %7s %12s %11s %14s\n", "mode", "policy", "threads", "MB/s", "efficiency", "ceiling MB/s");
+    int status = 0;
+    for (int p = 0; p < 3; p++) {
+        if (policy >= 0 && p != policy) {
+            continue;
+        }
+        for (int kernel = 0; kernel < BENCH_KERNELS - 1; kernel++) {
+            double single = 0;
+            for (int threads = 1; threads <= max_threads; threads++) {
+                double throughput = bench_measure(topology, &schedule, p, kernel, threads, total_bytes);
+                double ceiling = bench_measure(topology, &schedule, p, BENCH_KERNELS - 1, threads, total_bytes);
+                if (throughput < 0 || ceiling < 0) {
+                    fprintf(stderr, "Benchmark run failed.\n");
+                    status = 1;
+                    continue;
+                }
+                if (threads == 1) {
+                    single = throughput;
+                }
+                // without a 1-thread result there is nothing to compare against
+                if (single <= 0) {
+                    printf("%-8s %-8s %7d %12.1f %11s %14.1f\n", bench_kernel_names[kernel], bench_policy_names[p], threads,
+                        throughput, "-", ceiling);
+                    continue;
+                }
+                printf("%-8s %-8s %7d %12.1f %10.1f%% %14.1f\n", bench_kernel_names[kernel], bench_policy_names[p], threads,
+                    throughput, 100.0 * throughput / (threads * single), ceiling);
+            }
+        }
+    }
+    des_free(topology);
+    return status;
+}
+
+
+//// -----------------------benchmark baseline part-----------------------
+
+#define BASELINE_FORMAT 1
+#define BASELINE_MAX_ENTRIES 256
+#define BASELINE_MAX_RUNS 64
+#define BASELINE_MAD_SCALE 1.4826
+#define BASELINE_NOISE_SIGMAS 3.0
+
+static const char* baseline_engine_names[2] = { "scalar", "simd" };
+static const char* baseline_mode_names[4] = { "ecb", "cbc-enc", "cbc-dec", "ctr" };
+static const size_t baseline_sizes[2] = { 4096, 1 << 20 };
+
+
+/// <summary>
+/// One benchmark configuration and its throughput statistics, in MB/s.
+/// </summary>
+typedef struct baseline_entry {
+    int engine;
+    int mode;
+    size_t size;
+    int threads;
+    int runs;
+    double median;
+    double mad;
+} baseline_entry;
+
+
+/// <summary>
+/// Shared state of one timed baseline run: every thread works through its own buffer of
+/// "size" bytes until it has processed "bytes_per_thread".
+/// </summary>
+typedef struct baseline_run {
+    const des_key_schedule* schedule;
+    int engine;
+    int mode;
+    size_t size;
+    size_t bytes_per_thread;
+    unsigned char* buffers;
+} baseline_run;
+
+
+/// <summary>
+/// Processes one buffer with the engine and mode of a baseline entry. The SIMD engine runs
+/// the mode functions, the scalar engine one block at a time.
+/// </summary>
+static void baseline_kernel(const baseline_run* run, unsigned char* buffer) {
+    static const unsigned char iv[BLOCK_BYTES] = { 0 };
+    size_t blocks = run->size / BLOCK_BYTES;
+    if (run->mode == 0 && run->engine == 1) {
+        des_ecb_crypt(run->schedule, buffer, buffer, blocks, 0);
+    }
+    else if (run->mode == 0) {
+        for (size_t i = 0; i < blocks; i++) {
+            des_crypt_bytes(buffer + i * BLOCK_BYTES, buffer + i * BLOCK_BYTES, run->schedule, 0);
+        }
+    }
+    else if (run->mode == 1) {
+        des_cbc_encrypt(run->schedule, iv, buffer, buffer, blocks);
+    }
+    else if (run->mode == 2 && run->engine == 1) {
+        des_cbc_decrypt(run->schedule, iv, buffer, buffer, blocks);
+    }
+    else if (run->mode == 2) {
+        uint64_t chain = 0;
+        for (size_t i = 0; i < blocks; i++) {
+            uint64_t cipher_block = load_be64(buffer + i * BLOCK_BYTES);
+            store_be64(buffer + i * BLOCK_BYTES, des_crypt_block(cipher_block, run->schedule, 1) ^ chain);
+            chain = cipher_block;
+        }
+    }
+    else if (run->engine == 1) {
+        des_ctr_crypt(run->schedule, 0, buffer, buffer, run->size);
+    }
+    else {
+        for (size_t i = 0; i < blocks; i++) {
+            store_be64(buffer + i * BLOCK_BYTES, load_be64(buffer + i * BLOCK_BYTES) ^ des_crypt_block(i, run->schedule, 0));
+        }
+    }
+}
+
+
+/// <summary>
+/// parallel_for task of a baseline run.
+/// </summary>
+static void baseline_task(void* context, int index) {
+    baseline_run* run = (baseline_run*)context;
+    unsigned char* buffer = run->buffers + (size_t)index * run->size;
+    for (size_t done = 0; done < run->bytes_per_thread; done += run->size) {
+        baseline_kernel(run, buffer);
+    }
+}
+
+
+/// <summary>
+/// Sorts a short array of doubles in place.
+/// </summary>
+static void sort_doubles(double* values, int count) {
+    for (int i = 1; i < count; i++) {
+        double value = values[i];
+        int j = i;
+        for (; j > 0 && values[j - 1] > value; j--) {
+            values[j] = values[j - 1];
+        }
+        values[j] = value;
+    }
+}
+
+
+/// <summary>
+/// Median of an array of doubles. Reorders the array.
+/// </summary>
+static double median_of(double* values, int count) {
+    sort_doubles(values, count);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+
+/// <summary>
+/// Measures one baseline configuration with repeated runs and fills in its median and
+/// median absolute deviation.
+/// </summary>
+/// <param name="entry">Configuration to measure, receives runs, median and mad</param>
+/// <param name="runs">Number of timed runs, after one untimed warm-up</param>
+/// <param name="total_bytes">Bytes processed per run, split between the threads</param>
+/// <returns>0 on success, -1 on failure</returns>
+int baseline_measure(baseline_entry* entry, int runs, size_t total_bytes) {
+    des_key_schedule schedule;
+    fixture_setup(&schedule, NULL, 0);
+
+    baseline_run run;
+    run.schedule = &schedule;
+    run.engine = entry->engine;
+    run.mode = entry->mode;
+    run.size = entry->size;
+    run.bytes_per_thread = total_bytes / entry->threads;
+    if (run.bytes_per_thread < run.size) {
+        run.bytes_per_thread = run.size;
+    }
+    run.buffers = (unsigned char*)des_calloc((size_t)entry->threads, run.size);
+    if (run.buffers == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+
+    double samples[BASELINE_MAX_RUNS];
+    parallel_for(entry->threads, entry->threads, baseline_task, &run);
+    for (int r = 0; r < runs; r++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        parallel_for(entry->threads, entry->threads, baseline_task, &run);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        size_t processed = (run.bytes_per_thread + run.size - 1) / run.size * run.size * entry->threads;
+        samples[r] = (double)processed / seconds / 1e6;
+    }
+    des_free(run.buffers);
+
+    entry->runs = runs;
+    entry->median = median_of(samples, runs);
+    for (int r = 0; r < runs; r++) {
+        samples[r] = fabs(samples[r] - entry->median);
+    }
+    entry->mad = median_of(samples, runs);
+    return 0;
+}
+
+
+/// <summary>
+/// Lists the configurations measured by this build: every engine, mode and buffer size at
+/// 1, 2, 4, ... threads and at max_threads.
+/// </summary>
+/// <returns>Number of entries written</returns>
+static int baseline_configurations(int max_threads, baseline_entry* entries) {
+    int count = 0;
+    for (int engine = 0; engine < 2; engine++) {
+        if (engine == 1 && SIMD_LANES == 0) {
+            continue;
+        }
+        for (int mode = 0; mode < 4; mode++) {
+            // CBC encryption is serial, so it has no SIMD engine
+            if (engine == 1 && mode == 1) {
+                continue;
+            }
+            for (int s = 0; s < 2; s++) {
+                for (int threads = 1; threads <= max_threads; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2) {
+                    if (count < BASELINE_MAX_ENTRIES) {
+                        baseline_entry* entry = &entries[count++];
+                        memset(entry, 0, sizeof(*entry));
+                        entry->engine = engine;
+                        entry->mode = mode;
+                        entry->size = baseline_sizes[s];
+                        entry->threads = threads;
+                    }
+                }
+            }
+        }
+    }
+    return count;
+}
+
+
+/// <summary>
+/// Writes baseline entries as a versioned JSON document.
+/// </summary>
+/// <returns>0 on success, -1 on failure</returns>
+int baseline_write(const char* path, const baseline_entry* entries, int count) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return -1;
+    }
+    fprintf(file, "{\n  \"format\": %d,\n  \"entries\": [\n", BASELINE_FORMAT);
+    for (int i = 0; i < count; i++) {
+        const baseline_entry* entry = &entries[i];
+        fprintf(file, "    { \"engine\": \"%s\", \"mode\": \"%s\", \"size\": %zu, \"threads\": %d, \"runs\": %d, \"median_mbps\": %.2f, \"mad_mbps\": %.2f }%s\n",
+            baseline_engine_names[entry->engine], baseline_mode_names[entry->mode], entry->size, entry->threads,
+            entry->runs, entry->median, entry->mad, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+
+/// <summary>
+/// Skips JSON whitespace.
+/// </summary>
+static const char* json_skip(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+
+/// <summary>
+/// Reads a JSON string without escapes into a buffer.
+/// </summary>
+/// <returns>Position after the string, or NULL on malformed input</returns>
+static const char* json_string(const char* p, char* out, size_t capacity) {
+    p = json_skip(p);
+    if (*p != '"') {
+        return NULL;
+    }
+    size_t length = 0;
+    for (p++; *p != '"'; p++) {
+        if (*p == '\0' || *p == '\\' || length + 1 >= capacity) {
+            return NULL;
+        }
+        out[length++] = *p;
+    }
+    out[length] = '\0';
+    return p + 1;
+}
+
+
+/// <summary>
+/// Looks a name up in a table of names.
+/// </summary>
+/// <returns>Index of the name, or -1 if it is not in the table</returns>
+static int name_index(const char* const* names, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/// <summary>
+/// Parses one flat entry object of a baseline document.
+/// </summary>
+/// <returns>Position after the object, or NULL on malformed input</returns>
+static const char* baseline_parse_entry(const char* p, baseline_entry* entry) {
+    char name[32], value[32];
+    memset(entry, 0, sizeof(*entry));
+    entry->engine = entry->mode = -1;
+    p = json_skip(p);
+    if (*p++ != '{') {
+        return NULL;
+    }
+    while (p != NULL && *(p = json_skip(p)) != '}') {
+        if (*p == ',') {
+            p++;
+        }
+        p = json_string(p, name, sizeof(name));
+        if (p == NULL || *(p = json_skip(p)) != ':') {
+            return NULL;
+        }
+        p = json_skip(p + 1);
+        if (*p == '"') {
+            p = json_string(p, value, sizeof(value));
+            if (p != NULL && strcmp(name, "engine") == 0) {
+                entry->engine = name_index(baseline_engine_names, 2, value);
+            }
+            else if (p != NULL && strcmp(name, "mode") == 0) {
+                entry->mode = name_index(baseline_mode_names, 4, value);
+            }
+            continue;
+        }
+        char* end;
+        double number = strtod(p, &end);
+        if (end == p) {
+            return NULL;
+        }
+        p = end;
+        if (strcmp(name, "size") == 0)
+            entry->size = (size_t)number;
+        else if (strcmp(name, "threads") == 0)
+            entry->threads = (int)number;
+        else if (strcmp(name, "runs") == 0)
+            entry->runs = (int)number;
+        else if (strcmp(name, "median_mbps") == 0)
+            entry->median = number;
+        else if (strcmp(name, "mad_mbps") == 0)
+            entry->mad = number;
+    }
+    if (p == NULL || entry->engine < 0 || entry->mode < 0 || entry->size < BLOCK_BYTES || entry->size % BLOCK_BYTES != 0
+        || entry->threads <= 0 || entry->median <= 0) {
+        return NULL;
+    }
+    return p + 1;
+}
+
+
+/// <summary>
+/// Reads a baseline document written by baseline_write.
+/// </summary>
+/// <returns>Number of entries read, or -1 on failure</returns>
+int baseline_read(const char* path, baseline_entry* entries, int capacity) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return -1;
+    }
+    size_t length = 0, allocated = 4096;
+    char* text = (char*)des_malloc(allocated);
+    while (text != NULL) {
+        length += fread(text + length, 1, allocated - length - 1, file);
+        if (length + 1 < allocated) {
+            break;
+        }
+        allocated *= 2;
+        char* grown = (char*)des_realloc(text, allocated);
+        if (grown == NULL) {
+            des_free(text);
+        }
+        text = grown;
+    }
+    fclose(file);
+    if (text == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    text[length] = '\0';
+
+    int count = -1;
+    const char* format = strstr(text, "\"format\"");
+    const char* p = strstr(text, "\"entries\"");
+    if (format == NULL || atoi(json_skip(json_skip(format + 8) + 1)) != BASELINE_FORMAT) {
+        fprintf(stderr, "%s: unsupported baseline format.\n", path);
+    }
+    else if (p != NULL && (p = strchr(p, '[')) != NULL) {
+        count = 0;
+        for (p = json_skip(p + 1); p != NULL && *p != ']'; p = json_skip(p)) {
+            if (*p == ',') {
+                p = json_skip(p + 1);
+            }
+            if (count == capacity || (p = baseline_parse_entry(p, &entries[count])) == NULL) {
+                fprintf(stderr, "%s: malformed baseline entry %d.\n", path, count + 1);
+                count = -1;
+                break;
+            }
+            count++;
+        }
+    }
+    des_free(text);
+    return count;
+}
+
+
+/// <summary>
+/// Measures every configuration of this build and stores the results as a baseline.
+/// </summary>
+/// <param name="path">Baseline file to write</param>
+/// <param name="max_threads">Highest thread count, 0 for one per available CPU</param>
+/// <param name="runs">Timed runs per configuration</param>
+/// <param name="total_bytes">Bytes processed per run</param>
+/// <returns>0 on success, 1 on failure</returns>
+int run_baseline_save(const char* path, int max_threads, int runs, size_t total_bytes) {
+    if (max_threads <= 0) {
+        max_threads = (int)std::thread::hardware_concurrency();
+        max_threads = max_threads > 0 ? max_threads : 1;
+    }
+    baseline_entry* entries = (baseline_entry*)des_malloc(BASELINE_MAX_ENTRIES * sizeof(baseline_entry));
+    if (entries == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+    int count = baseline_configurations(max_threads, entries);
+    int status = 0;
+    printf("%-7s %-8s %8s %7s %12s %10s\n", "engine", "mode", "size", "threads", "median MB/s", "MAD MB/s");
+    for (int i = 0; i < count && status == 0; i++) {
+        baseline_entry* entry = &entries[i];
+        status = baseline_measure(entry, runs, total_bytes) == 0 ? 0 : 1;
+        printf("%-7s %-8s %8zu %7d %12.1f %10.2f\n", baseline_engine_names[entry->engine], baseline_mode_names[entry->mode],
+            entry->size, entry->threads, entry->median, entry->mad);
+    }
+    if (status == 0 && baseline_write(path, entries, count) != 0) {
+        fprintf(stderr, "Cannot write %s.\n", path);
+        status = 1;
+    }
+    des_free(entries);
+    return status;
+}
+
+
+/// <summary>
+/// Re-measures every configuration of a baseline and flags regressions. A configuration
+/// regresses when its median drops by more than threshold percent of the baseline median
+/// and by more than BASELINE_NOISE_SIGMAS of the combined MAD based noise of both sides.
+/// Configurations this build cannot run (e.g. SIMD entries on a scalar build) are skipped.
+/// </summary>
+/// <param name="path">Baseline file to read</param>
+/// <param name="threshold">Allowed slowdown in percent</param>
+/// <param name="runs">Timed runs per configuration, 0 for the count stored in the baseline</param>
+/// <param name="total_bytes">Bytes processed per run</param>
+/// <returns>0 if nothing regressed, 1 on regressions, 2 on failure</returns>
+int run_baseline_compare(const char* path, double threshold, int runs, size_t total_bytes) {
+    baseline_entry* entries = (baseline_entry*)des_malloc(BASELINE_MAX_ENTRIES * sizeof(baseline_entry));
+    if (entries == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 2;
+    }
+    int count = baseline_read(path, entries, BASELINE_MAX_ENTRIES);
+    if (count < 0) {
+        des_free(entries);
+        return 2;
+    }
+
+    int regressions = 0, status = 0;
+    printf("%-7s %-8s %8s %7s %12s %12s %8s  %s\n", "engine", "mode", "size", "threads", "base MB/s", "now MB/s", "change", "verdict");
+    for (int i = 0; i < count && status == 0; i++) {
+        baseline_entry* base = &entries[i];
+        baseline_entry now = *base;
+        const char* verdict;
+        if (base->engine == 1 && SIMD_LANES == 0) {
+            printf("%-7s %-8s %8zu %7d %12.1f %12s %8s  %s\n", baseline_engine_names[base->engine],
+                baseline_mode_names[base->mode], base->size, base->threads, base->median, "-", "-", "skipped");
+            continue;
+        }
+        if (baseline_measure(&now, runs > 0 ? runs : (base->runs > 0 && base->runs <= BASELINE_MAX_RUNS ? base->runs : 7), total_bytes) != 0) {
+            status = 2;
+            break;
+        }
+        double noise = BASELINE_NOISE_SIGMAS * BASELINE_MAD_SCALE * sqrt(base->mad * base->mad + now.mad * now.mad);
+        double limit = threshold / 100 * base->median;
+        double drop = base->median - now.median;
+        verdict = drop > limit && drop > noise ? "REGRESSION" : "ok";
+        regressions += drop > limit && drop > noise;
+        printf("%-7s %-8s %8zu %7d %12.1f %12.1f %7.1f%%  %s\n", baseline_engine_names[base->engine],
+            baseline_mode_names[base->mode], base->size, base->threads, base->median, now.median,
+            now.median > 0 ? 100.0 * (now.median - base->median) / base->median : 0.0, verdict);
+    }
+    des_free(entries);
+    if (status != 0) {
+        return status;
+    }
+    if (regressions) {
+        printf("FAILED: %d configuration(s) regressed beyond %.1f%%.\n", regressions, threshold);
+        return 1;
+    }
+    printf("OK: no regressions beyond %.1f%%.\n", threshold);
+    return 0;
+}
+
+
+//// -----------------------allocation check part-----------------------
+
+#define ALLOC_CHECK_BYTES 65536
+#define ALLOC_CHECK_ROUNDS 16
+
+
+/// <summary>
+/// Prints the counters of one operation.
+/// </summary>
+static void print_alloc_stats(const char* name, const alloc_stats* stats) {
+    printf("%-28s allocations: %llu, bytes: %llu, live bytes: %lld, peak bytes: %lld\n", name,
+        (unsigned long long)stats->allocations, (unsigned long long)stats->bytes,
+        (long long)stats->live_bytes, (long long)stats->peak_bytes);
+}
+
+
+/// <summary>
+/// Runs every steady-state encrypt path after a warm-up call and fails if any of them
+/// allocates. The string based round function and a scheduler lifetime (operator new,
+/// std containers and threads) are measured too, for reference only.
+/// </summary>
+/// <returns>0 if the steady-state paths do not allocate, 1 if they do, 2 if tracking is not built in</returns>
+int run_alloc_check() {
+    if (!DES_ALLOC_TRACKING) {
+        fprintf(stderr, "Allocation tracking is not built in, rebuild with DES_ALLOC_TRACKING=1.\n");
+        return 2;
+    }
+
+    const unsigned char* iv = fixture_iv;
+    des_key_schedule schedule;
+    fixture_setup(&schedule, NULL, 0);
+    unsigned char* buffer = (unsigned char*)des_calloc(ALLOC_CHECK_BYTES, 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return 1;
+    }
+    crypt_request requests[64];
+    for (int i = 0; i < 64; i++) {
+        requests[i].schedule = &schedule;
+        requests[i].iv = iv;
+        requests[i].in = buffer + i * 64;
+        requests[i].out = buffer + i * 64;
+        requests[i].length = 64;
+    }
+
+    int failed = 0;
+    for (int path = 0; path < 7; path++) {
+        alloc_stats stats;
+        alloc_stats* previous = NULL;
+        const char* name = "";
+        for (int round = 0; round <= ALLOC_CHECK_ROUNDS; round++) {
+            if (round == 1) {
+                previous = alloc_scope_begin(&stats);
+            }
+            size_t blocks = ALLOC_CHECK_BYTES / BLOCK_BYTES;
+            switch (path) {
+            case 0: name = "ECB encrypt"; des_ecb_crypt(&schedule, buffer, buffer, blocks, 0); break;
+            case 1: name = "ECB decrypt"; des_ecb_crypt(&schedule, buffer, buffer, blocks, 1); break;
+            case 2: name = "CBC encrypt"; des_cbc_encrypt(&schedule, iv, buffer, buffer, blocks); break;
+            case 3: name = "CBC decrypt"; des_cbc_decrypt(&schedule, iv, buffer, buffer, blocks); break;
+            case 4: name = "CTR"; des_ctr_crypt(&schedule, 0, buffer, buffer, ALLOC_CHECK_BYTES); break;
+            case 5: name = "batch ECB"; des_crypt_batch(requests, 64, MODE_ECB, 0); break;
+            case 6: name = "key setup"; des_key_setup(fixture_key, &schedule); break;
+            }
+        }
+        alloc_scope_end(previous);
+        print_alloc_stats(name, &stats);
+        if (stats.allocations != 0) {
+            failed = 1;
+        }
+    }
+
+    // the original string path, reported but not checked
+    char** keys = (char**)des_malloc(QUARTER_NUM_BITS * sizeof(char*));
+    if (keys == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < QUARTER_NUM_BITS; i++) {
+        keys[i] = (char*)des_malloc(EXP_HALF_NUM_BITS + 1);
+        if (keys[i] == NULL) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(keys[i], '0', EXP_HALF_NUM_BITS);
+        keys[i][EXP_HALF_NUM_BITS] = '\0';
+    }
+    char block[NUM_BITS + 1];
+    memset(block, '0', NUM_BITS);
+    block[NUM_BITS] = '\0';
+    alloc_stats stats;
+    alloc_stats* previous = alloc_scope_begin(&stats);
+    char* encrypted = encryption_rounds(block, keys);
+    alloc_scope_end(previous);
+    print_alloc_stats("encryption_rounds (string)", &stats);
+    des_free(encrypted);
+    free_keys_array(keys, QUARTER_NUM_BITS);
+
+    previous = alloc_scope_begin(&stats);
+    scheduler* sched = scheduler_create(2);
+    crypt_job job;
+    crypt_job_init(&job, fixture_key, MODE_CTR, 0, iv, buffer, buffer, ALLOC_CHECK_BYTES);
+    scheduler_submit(sched, &job);
+    scheduler_destroy(sched);
+    alloc_scope_end(previous);
+    print_alloc_stats("scheduler (C++ objects)", &stats);
+    des_free(buffer);
+
+    printf(failed ? "FAILED: the steady-state encrypt path allocates.\n" : "OK: the steady-state encrypt path does not allocate.\n");
+    return failed;
+}
+
+
+//// -----------------------in-place check part-----------------------
+
+#define INPLACE_CHECK_BYTES 4099
+#define INPLACE_CHECK_SHIFT 24
+
+
+/// <summary>
+/// Runs one mode function from in to out. ECB and CBC process the whole blocks of length.
+/// </summary>
+static void inplace_check_crypt(const des_key_schedule* schedule, int mode, int decrypt, const unsigned char* iv,
+    const unsigned char* in, unsigned char* out, size_t length) {
+    if (mode == MODE_ECB)
+        des_ecb_crypt(schedule, in, out, length / BLOCK_BYTES, decrypt);
+    else if (mode == MODE_CBC && decrypt)
+        des_cbc_decrypt(schedule, iv, in, out, length / BLOCK_BYTES);
+    else if (mode == MODE_CBC)
+        des_cbc_encrypt(schedule, iv, in, out, length / BLOCK_BYTES);
+    else
+        des_stream_mode_crypt(schedule, mode, decrypt, iv, in, out, length);
+}
+
+
+/// <summary>
+/// Checks the aliasing rules of every mode: in place (out == in) and shifted down
+/// (out < in) calls of the mode functions, in-place batches and iovec chains (ECB, CBC
+/// and CTR), the OFB prefetcher, and the
+/// des_encrypt_inplace/des_decrypt_inplace round trip, all against separate buffers.
+/// </summary>
+/// <returns>0 if every case matches, 1 otherwise</returns>
+int run_inplace_check() {
+    const unsigned char* iv = fixture_iv;
+    des_key_schedule schedule;
+    size_t size = INPLACE_CHECK_BYTES + INPLACE_CHECK_SHIFT;
+    unsigned char* input = (unsigned char*)des_malloc(size);
+    unsigned char* expected = (unsigned char*)des_malloc(size);
+    unsigned char* work = (unsigned char*)des_malloc(size);
+    if (input == NULL || expected == NULL || work == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    fixture_setup(&schedule, input, size);
+
+    int failed = 0;
+    for (int mode = MODE_ECB; mode <= MODE_CFB8; mode++) {
+        size_t length = mode > MODE_CBC ? INPLACE_CHECK_BYTES : INPLACE_CHECK_BYTES / BLOCK_BYTES * BLOCK_BYTES;
+        for (int decrypt = 0; decrypt < 2; decrypt++) {
+            int ok[4];
+            inplace_check_crypt(&schedule, mode, decrypt, iv, input, expected, length);
+
+            memcpy(work, input, length);
+            inplace_check_crypt(&schedule, mode, decrypt, iv, work, work, length);
+            ok[0] = memcmp(work, expected, length) == 0;
+
+            memcpy(work + INPLACE_CHECK_SHIFT, input, length);
+            inplace_check_crypt(&schedule, mode, decrypt, iv, work + INPLACE_CHECK_SHIFT, work, length);
+            ok[1] = memcmp(work, expected, length) == 0;
+
+            if (mode > MODE_CTR) {
+                // no batch or iovec API for the feedback modes; OFB checks the prefetcher instead
+                memcpy(work, input, length);
+                ofb_prefetcher* prefetcher = mode == MODE_OFB ? ofb_prefetcher_create(&schedule, iv) : NULL;
+                for (size_t done = 0; prefetcher != NULL && done < length; done += 1000) {
+                    ofb_prefetch_crypt(prefetcher, work + done, work + done, length - done < 1000 ? length - done : 1000);
+                }
+                ofb_prefetcher_destroy(prefetcher);
+                int prefetched = mode != MODE_OFB || memcmp(work, expected, length) == 0;
+                printf("%-5s %-8s in place: %s, shifted: %s%s%s\n", mode_names[mode], decrypt ? "decrypt" : "encrypt",
+                    ok[0] ? "ok" : "FAILED", ok[1] ? "ok" : "FAILED", mode == MODE_OFB ? ", prefetched: " : "",
+                    mode == MODE_OFB ? (prefetched ? "ok" : "FAILED") : "");
+                failed |= !ok[0] || !ok[1] || !prefetched;
+                continue;
+            }
+
+            crypt_request requests[8];
+            memcpy(work, input, length);
+            for (int i = 0; i < 8; i++) {
+                size_t first = length / 8 / BLOCK_BYTES * BLOCK_BYTES * i;
+                requests[i].schedule = &schedule;
+                requests[i].iv = iv;
+                requests[i].in = work + first;
+                requests[i].out = work + first;
+                requests[i].length = i == 7 ? length - first : length / 8 / BLOCK_BYTES * BLOCK_BYTES;
+            }
+            ok[2] = des_crypt_batch(requests, 8, mode, decrypt) == 0;
+            for (int i = 0; i < 8 && ok[2]; i++) {
+                unsigned char* reference = expected + (requests[i].out - work);
+                inplace_check_crypt(&schedule, mode, decrypt, iv, input + (requests[i].out - work), reference, requests[i].length);
+                ok[2] = memcmp(requests[i].out, reference, requests[i].length) == 0;
+            }
+            inplace_check_crypt(&schedule, mode, decrypt, iv, input, expected, length);
+
+            struct iovec vectors[3];
+            memcpy(work, input, length);
+            vectors[0].iov_base = work;
+            vectors[0].iov_len = 13;
+            vectors[1].iov_base = work + 13;
+            vectors[1].iov_len = 1000;
+            vectors[2].iov_base = work + 1013;
+            vectors[2].iov_len = length - 1013;
+            ok[3] = (decrypt ? des_decryptv(&schedule, mode, iv, vectors, 3, vectors, 3)
+                : des_encryptv(&schedule, mode, iv, vectors, 3, vectors, 3)) == 0 && memcmp(work, expected, length) == 0;
+
+            printf("%-5s %-8s in place: %s, shifted: %s, batch: %s, iovec: %s\n", mode_names[mode], decrypt ? "decrypt" : "encrypt",
+                ok[0] ? "ok" : "FAILED", ok[1] ? "ok" : "FAILED", ok[2] ? "ok" : "FAILED", ok[3] ? "ok" : "FAILED");
+            failed |= !ok[0] || !ok[1] || !ok[2] || !ok[3];
+        }
+
+        int round_trip = 1;
+        for (size_t plain = 0; plain <= 2 * BLOCK_BYTES + 1 && round_trip; plain++) {
+            size_t length = plain;
+            memcpy(work, input, plain);
+            round_trip = des_encrypt_inplace(&schedule, mode, iv, work, &length, plain + BLOCK_BYTES) == 0
+                && (mode > MODE_CBC ? length == plain : length == (plain / BLOCK_BYTES + 1) * BLOCK_BYTES)
+                && des_decrypt_inplace(&schedule, mode, iv, work, &length) == 0
+                && length == plain && memcmp(work, input, plain) == 0;
+            length = plain;
+            round_trip = round_trip && (mode > MODE_CBC || des_encrypt_inplace(&schedule, mode, iv, work, &length, plain) != 0);
+        }
+        printf("%-5s round trip in the caller buffer: %s\n", mode_names[mode], round_trip ? "ok" : "FAILED");
+        failed |= !round_trip;
+    }
+    des_free(input);
+    des_free(expected);
+    des_free(work);
+
+    printf(failed ? "FAILED: in-place operation does not match separate buffers.\n" : "OK: in-place operation matches separate buffers.\n");
+    return failed;
+}
+
+
+//// -----------------------container check part-----------------------
+
+#define CONTAINER_CHECK_BYTES 10007
+#define CONTAINER_CHECK_CHUNK 512
+#define CONTAINER_CHECK_RANGES 64
+
+
+/// <summary>
+/// Writes data to a new container in the temporary file, appending in uneven pieces.
+/// </summary>
+/// <returns>0 on success, -1 on failure</returns>
+static int container_check_write(FILE* file, const des_key_schedule* schedule, int mode, const unsigned char* iv,
+    const unsigned char* data, size_t length) {
+    container_writer* writer = container_create(file, schedule, mode, iv, CONTAINER_CHECK_CHUNK);
+    if (writer == NULL) {
+        return -1;
+    }
+    int status = 0;
+    for (size_t done = 0, piece = 1; status == 0 && done < length; done += piece, piece = piece * 3 + 1) {
+        if (piece > length - done) {
+            piece = length - done;
+        }
+        status = container_append(writer, data + done, piece);
+    }
+    return container_finish(writer) == 0 ? status : -1;
+}
+
+
+/// <summary>
+/// Overwrites a big-endian 32-bit field of the temporary file and checks that
+/// container_open rejects the result.
+/// </summary>
+static int container_check_rejects(FILE* file, const des_key_schedule* schedule, uint64_t offset, uint32_t value) {
+    unsigned char field[4];
+    store_be32(field, value);
+    if (file_seek(file, offset) != 0 || fwrite(field, 1, 4, file) != 4 || fflush(file) != 0) {
+        return 0;
+    }
+    container_reader* reader = container_open(file, schedule);
+    if (reader != NULL) {
+        container_close(reader);
+        return 0;
+    }
+    return 1;
+}
+
+
+/// <summary>
+/// Round-trips data of several sizes through a container in every container mode and
+/// reads whole and random byte ranges back, with one and with all threads. Then damages
+/// the trailer and the index and checks that container_open rejects them; the rejected
+/// opens print their reason.
+/// </summary>
+/// <returns>0 if every case passes, 1 otherwise</returns>
+int run_container_check() {
+    static const size_t sizes[5] = { 0, 1, CONTAINER_CHECK_CHUNK, CONTAINER_CHECK_CHUNK + 7, CONTAINER_CHECK_BYTES };
+    const unsigned char* iv = fixture_iv;
+    des_key_schedule schedule;
+    unsigned char* input = (unsigned char*)des_malloc(CONTAINER_CHECK_BYTES);
+    unsigned char* output = (unsigned char*)des_malloc(CONTAINER_CHECK_BYTES);
+    if (input == NULL || output == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    fixture_setup(&schedule, input, CONTAINER_CHECK_BYTES);
+
+    int failed = 0;
+    for (int mode = MODE_ECB; mode <= MODE_CTR; mode++) {
+        for (int s = 0; s < 5; s++) {
+            size_t length = sizes[s];
+            FILE* file = tmpfile();
+            if (file == NULL) {
+                fprintf(stderr, "Failed to create a temporary file.\n");
+                exit(EXIT_FAILURE);
+            }
+            int written = container_check_write(file, &schedule, mode, iv, input, length) == 0 && fflush(file) == 0;
+            container_reader* reader = written ? container_open(file, &schedule) : NULL;
+            int ranges = reader != NULL && container_plain_size(reader) == length
+                && container_read_range(reader, 0, length, output, 1) == 0 && memcmp(output, input, length) == 0;
+            uint32_t seed = 12345;
+            for (int r = 0; ranges && length > 0 && r < CONTAINER_CHECK_RANGES; r++) {
+                seed = seed * 1103515245 + 12345;
+                size_t offset = (seed >> 8) % length;
+                seed = seed * 1103515245 + 12345;
+                size_t count = (seed >> 8) % (length - offset + 1);
+                memset(output, 0, count);
+                ranges = container_read_range(reader, offset, count, output, r & 1 ? 0 : 1) == 0
+                    && memcmp(output, input + offset, count) == 0;
+            }
+            // reading past the end has to fail
+            ranges = ranges && container_read_range(reader, length, 1, output, 1) != 0;
+            if (reader != NULL) {
+                container_close(reader);
+            }
+
+            int rejected = 1;
+            uint64_t size = 0;
+            if (written && length > 0 && file_size(file, &size) == 0) {
+                // a chunk count that would overflow the index allocation
+                rejected = container_check_rejects(file, &schedule, size - CONTAINER_TRAILER_SIZE + 8, 0xFFFFFFFFu);
+                uint32_t chunk_count = (uint32_t)((length + CONTAINER_CHECK_CHUNK - 1) / CONTAINER_CHECK_CHUNK);
+                uint64_t index_offset = size - CONTAINER_TRAILER_SIZE - (uint64_t)chunk_count * CONTAINER_INDEX_ENTRY_SIZE;
+                // one chunk more than the index holds
+                rejected = rejected && container_check_rejects(file, &schedule, size - CONTAINER_TRAILER_SIZE + 8, chunk_count + 1);
+                container_check_rejects(file, &schedule, size - CONTAINER_TRAILER_SIZE + 8, chunk_count);
+                // a stored length that is not whole blocks, or reaches into the index
+                uint32_t stored_length = mode == MODE_CTR ? (uint32_t)(size + 1) : 7;
+                rejected = rejected && container_check_rejects(file, &schedule, index_offset + 12, stored_length);
+            }
+            fclose(file);
+            printf("%s %5zu bytes round trip and ranges: %s, damaged index rejected: %s\n", mode_names[mode], length,
+                ranges ? "ok" : "FAILED", rejected ? "ok" : "FAILED");
+            failed |= !ranges || !rejected;
+        }
+    }
+    des_free(input);
+    des_free(output);
+
+    printf(failed ? "FAILED: the container does not round-trip or accepts a damaged index.\n" : "OK: the container round-trips and rejects damaged indexes.\n");
+    return failed;
+}
+
+
+//// -----------------------key setup check part-----------------------
+
+#define KEY_CHECK_KEYS 10007
+#define KEY_CHECK_CACHED 300
+
+
+/// <summary>
+/// Checks des_key_setup_bulk and key_cache_lookup_many against des_key_setup over random
+/// keys: every lane remainder, several parallel_for chunks on one and on all threads, and
+/// cache lookups with repeated keys, misses and hits.
+/// </summary>
+/// <returns>0 if every schedule matches, 1 otherwise</returns>
+int run_key_setup_check() {
+    unsigned char* keys = (unsigned char*)des_malloc(KEY_CHECK_KEYS * BLOCK_BYTES);
+    des_key_schedule* expected = (des_key_schedule*)des_malloc(KEY_CHECK_KEYS * sizeof(des_key_schedule));
+    des_key_schedule* bulk = (des_key_schedule*)des_malloc(KEY_CHECK_KEYS * sizeof(des_key_schedule));
+    if (keys == NULL || expected == NULL || bulk == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t seed = 0x0123456789ABCDEFULL;
+    for (int i = 0; i < KEY_CHECK_KEYS; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        store_be64(keys + i * BLOCK_BYTES, seed);
+        des_key_setup(keys + i * BLOCK_BYTES, &expected[i]);
+    }
+
+    int lanes_ok = 1;
+    for (int count = 1; count <= 2 * KEY_LANES + 1; count++) {
+        des_key_setup_bulk(keys, count, bulk, 1);
+        lanes_ok = lanes_ok && memcmp(bulk, expected, count * sizeof(des_key_schedule)) == 0;
+    }
+    printf("bulk key setup, 1 to %d keys: %s\n", 2 * KEY_LANES + 1, lanes_ok ? "ok" : "FAILED");
+
+    int threads_ok[2];
+    for (int t = 0; t < 2; t++) {
+        memset(bulk, 0, KEY_CHECK_KEYS * sizeof(des_key_schedule));
+        des_key_setup_bulk(keys, KEY_CHECK_KEYS, bulk, t == 0 ? 1 : 0);
+        threads_ok[t] = memcmp(bulk, expected, KEY_CHECK_KEYS * sizeof(des_key_schedule)) == 0;
+        printf("bulk key setup, %d keys on %s: %s\n", KEY_CHECK_KEYS, t == 0 ? "one thread" : "all threads",
+            threads_ok[t] ? "ok" : "FAILED");
+    }
+
+    // every key twice per call: within a call both copies miss, the second call hits them
+    key_cache* cache = new key_cache();
+    const unsigned char* lookup_keys[2 * KEY_CHECK_CACHED];
+    des_key_schedule* lookup_schedules[2 * KEY_CHECK_CACHED];
+    int cache_ok = 1;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 2 * KEY_CHECK_CACHED; i++) {
+            lookup_keys[i] = keys + (i % KEY_CHECK_CACHED) * BLOCK_BYTES;
+            lookup_schedules[i] = &bulk[i];
+        }
+        memset(bulk, 0, 2 * KEY_CHECK_CACHED * sizeof(des_key_schedule));
+        key_cache_lookup_many(cache, lookup_keys, 2 * KEY_CHECK_CACHED, lookup_schedules);
+        for (int i = 0; i < 2 * KEY_CHECK_CACHED; i++) {
+            cache_ok = cache_ok && memcmp(&bulk[i], &expected[i % KEY_CHECK_CACHED], sizeof(des_key_schedule)) == 0;
+        }
+    }
+    // only keys sharing a slot can miss in the second call
+    cache_ok = cache_ok && cache->hits + cache->misses == 4 * KEY_CHECK_CACHED && cache->hits >= 2 * KEY_CHECK_CACHED - 2 * KEY_CHECK_CACHED / 4;
+    printf("key cache bulk lookups, %llu hits, %llu misses: %s\n", (unsigned long long)cache->hits,
+        (unsigned long long)cache->misses, cache_ok ? "ok" : "FAILED");
+    delete cache;
+
+    des_free(keys);
+    des_free(expected);
+    des_free(bulk);
+    int failed = !lanes_ok || !threads_ok[0] || !threads_ok[1] || !cache_ok;
+    printf(failed ? "FAILED: bulk key setup does not match des_key_setup.\n" : "OK: bulk key setup matches des_key_setup.\n");
+    return failed;
+}
+
+
+//// -----------------------async check part-----------------------
+
+#define ASYNC_CHECK_BYTES 1000003
+#define ASYNC_CHECK_SEGMENT 65536
+#define ASYNC_CHECK_CANCEL_AFTER 3
+
+#if DES_HAS_COROUTINES
+
+/// <summary>
+/// State shared by the async check coroutines. results[mode] holds, per mode, whether the
+/// single awaits, the segmented encryption, the segmented decryption and the cancellation passed.
+/// </summary>
+typedef struct async_check_state {
+    async_executor* executor;
+    const des_key_schedule* schedule;
+    const unsigned char* iv;
+    const unsigned char* input;
+    std::thread::id executor_thread;
+    int results[MODE_CFB8 + 1][4];
+} async_check_state;
+
+
+/// <summary>
+/// Returns the number of bytes the async check processes in a mode, whole blocks for ECB and CBC.
+/// </summary>
+static size_t async_check_length(int mode) {
+    return mode <= MODE_CBC ? ASYNC_CHECK_BYTES / BLOCK_BYTES * BLOCK_BYTES : ASYNC_CHECK_BYTES;
+}
+
+
+/// <summary>
+/// Awaits an encryption and its in-place decryption, checks both against the synchronous
+/// functions and checks that every await resumed on the executor's thread. A job with
+/// invalid parameters has to complete at once with -1.
+/// </summary>
+static async_task async_check_single(async_check_state* state, int mode) {
+    size_t length = async_check_length(mode);
+    unsigned char* out = (unsigned char*)des_malloc(length);
+    unsigned char* expected = (unsigned char*)des_malloc(length);
+    if (out == NULL || expected == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(out);
+        des_free(expected);
+        co_return 0;
+    }
+    inplace_check_crypt(state->schedule, mode, 0, state->iv, state->input, expected, length);
+
+    int status = co_await encrypt_async(state->executor, state->schedule, mode, state->iv, state->input, out, length);
+    int ok = status == 0 && std::this_thread::get_id() == state->executor_thread && memcmp(out, expected, length) == 0;
+    status = co_await decrypt_async(state->executor, state->schedule, mode, state->iv, out, out, length);
+    ok = ok && status == 0 && std::this_thread::get_id() == state->executor_thread && memcmp(out, state->input, length) == 0;
+    if (mode <= MODE_CBC) {
+        status = co_await encrypt_async(state->executor, state->schedule, mode, state->iv, state->input, out, BLOCK_BYTES - 1);
+        ok = ok && status == -1;
+    }
+    des_free(out);
+    des_free(expected);
+    co_return ok;
+}
+
+
+/// <summary>
+/// Runs a segmented operation and checks the progress after every segment: done grows by
+/// one segment each time and out[0, done) already holds the final result.
+/// </summary>
+static async_task async_check_progress(async_check_state* state, int mode, int decrypt) {
+    size_t length = async_check_length(mode);
+    unsigned char* out = (unsigned char*)des_malloc(length);
+    unsigned char* expected = (unsigned char*)des_malloc(length);
+    if (out == NULL || expected == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(out);
+        des_free(expected);
+        co_return 0;
+    }
+    inplace_check_crypt(state->schedule, mode, decrypt, state->iv, state->input, expected, length);
+
+    crypt_progress progress;
+    crypt_progress_init(&progress, state->executor, state->schedule, mode, decrypt, state->iv, state->input, out, length,
+        ASYNC_CHECK_SEGMENT);
+    int ok = 1;
+    size_t steps = 0;
+    while (ok && !crypt_progress_finished(&progress)) {
+        int status = co_await crypt_progress_next(&progress);
+        steps++;
+        size_t done = steps * ASYNC_CHECK_SEGMENT < length ? steps * ASYNC_CHECK_SEGMENT : length;
+        ok = status == 0 && progress.done == done && std::this_thread::get_id() == state->executor_thread
+            && memcmp(out, expected, done) == 0;
+    }
+    ok = ok && steps == (length + ASYNC_CHECK_SEGMENT - 1) / ASYNC_CHECK_SEGMENT;
+    des_free(out);
+    des_free(expected);
+    co_return ok;
+}
+
+
+/// <summary>
+/// Cancels a segmented encryption after ASYNC_CHECK_CANCEL_AFTER segments and checks that
+/// it stops there: the finished segments are correct, nothing after them is written, and
+/// a further crypt_progress_next gives -1.
+/// </summary>
+static async_task async_check_cancel(async_check_state* state, int mode) {
+    size_t length = async_check_length(mode);
+    unsigned char* out = (unsigned char*)des_malloc(length);
+    unsigned char* expected = (unsigned char*)des_malloc(length);
+    if (out == NULL || expected == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        des_free(out);
+        des_free(expected);
+        co_return 0;
+    }
+    inplace_check_crypt(state->schedule, mode, 0, state->iv, state->input, expected, length);
+    memset(out, 0xA5, length);
+
+    crypt_progress progress;
+    crypt_progress_init(&progress, state->executor, state->schedule, mode, 0, state->iv, state->input, out, length,
+        ASYNC_CHECK_SEGMENT);
+    int ok = 1;
+    int steps = 0;
+    while (ok && !crypt_progress_finished(&progress)) {
+        ok = co_await crypt_progress_next(&progress) == 0;
+        if (++steps == ASYNC_CHECK_CANCEL_AFTER) {
+            crypt_progress_cancel(&progress);
+        }
+    }
+    size_t done = (size_t)ASYNC_CHECK_CANCEL_AFTER * ASYNC_CHECK_SEGMENT;
+    ok = ok && steps == ASYNC_CHECK_CANCEL_AFTER && progress.done == done && memcmp(out, expected, done) == 0;
+    for (size_t i = done; ok && i < length; i++) {
+        ok = out[i] == 0xA5;
+    }
+    int status = co_await crypt_progress_next(&progress);
+    ok = ok && status == -1 && progress.done == done;
+    des_free(out);
+    des_free(expected);
+    co_return ok;
+}
+
+
+/// <summary>
+/// Runs every check of one mode, one after the other.
+/// </summary>
+static async_task async_check_mode(async_check_state* state, int mode) {
+    state->results[mode][0] = co_await async_check_single(state, mode);
+    state->results[mode][1] = co_await async_check_progress(state, mode, 0);
+    state->results[mode][2] = co_await async_check_progress(state, mode, 1);
+    state->results[mode][3] = co_await async_check_cancel(state, mode);
+    co_return 0;
+}
+
+
+/// <summary>
+/// Checks the coroutine API in every mode, all modes at once on one executor: single
+/// encrypt_async and decrypt_async awaits against the synchronous functions, resumption
+/// on the executor's thread, segmented operations with their progress, and cancellation.
+/// The rejected job prints its reason.
+/// </summary>
+/// <returns>0 if every case passes, 1 otherwise</returns>
+int run_async_check() {
+    des_key_schedule schedule;
+    unsigned char* input = (unsigned char*)des_malloc(ASYNC_CHECK_BYTES);
+    if (input == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    fixture_setup(&schedule, input, ASYNC_CHECK_BYTES);
+
+    scheduler* pool = scheduler_create(0);
+    async_check_state state;
+    memset(state.results, 0, sizeof(state.results));
+    state.executor = executor_create(pool);
+    state.schedule = &schedule;
+    state.iv = fixture_iv;
+    state.input = input;
+    state.executor_thread = std::this_thread::get_id();
+    for (int mode = MODE_ECB; mode <= MODE_CFB8; mode++) {
+        executor_spawn(state.executor, async_check_mode(&state, mode));
+    }
+    executor_run(state.executor);
+    executor_destroy(state.executor);
+    scheduler_destroy(pool);
+    des_free(input);
+
+    int failed = 0;
+    for (int mode = MODE_ECB; mode <= MODE_CFB8; mode++) {
+        const int* result = state.results[mode];
+        printf("%-5s await: %s, segmented encrypt: %s, segmented decrypt: %s, cancel: %s\n", mode_names[mode],
+            result[0] ? "ok" : "FAILED", result[1] ? "ok" : "FAILED", result[2] ? "ok" : "FAILED", result[3] ? "ok" : "FAILED");
+        failed |= !result[0] || !result[1] || !result[2] || !result[3];
+    }
+    printf(failed ? "FAILED: the async API does not match the synchronous path.\n" : "OK: the async API matches the synchronous path.\n");
+    return failed;
+}
+
+#else
+
+int run_async_check() {
+    fprintf(stderr, "Coroutines are not built in, rebuild with C++20.\n");
+    return 2;
+}
+
+#endif
+
+
+//// -----------------------command line part-----------------------
+
+
+/// <summary>
+/// Parses a string of hexadecimal digits into bytes.
+/// </summary>
+/// <param name="hex">Hexadecimal string, exactly 2 * bytes digits</param>
+/// <param name="out">Destination bytes</param>
+/// <param name="bytes">Number of bytes expected</param>
+/// <returns>0 on success, -1 on invalid input</returns>
+int parse_hex_bytes(const char* hex, unsigned char* out, int bytes) {
+    if ((int)strlen(hex) != bytes * 2) {
+        return -1;
+    }
+    for (int i = 0; i < bytes; i++) {
+        unsigned int high = hex_char_to_int(hex[i * 2]);
+        unsigned int low = hex_char_to_int(hex[i * 2 + 1]);
+        if (high > 15 || low > 15) {
+            return -1;
+        }
+        out[i] = (unsigned char)(high * 16 + low);
+    }
+    return 0;
+}
+
+
+/// <summary>
+/// Prints the command line usage.
+/// </summary>
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s                                             run the built-in demo\n", program);
+    fprintf(stderr, "  %s filter <encrypt|decrypt> <ecb|cbc|ctr|ofb|cfb|cfb8> <key hex> [iv hex]\n", program);
+    fprintf(stderr, "      stream stdin to stdout with constant memory\n");
+#if DES_HAS_DAEMON
+    fprintf(stderr, "  %s daemon <socket path> [window us] [threads]\n", program);
+    fprintf(stderr, "      serve encrypt/decrypt requests from local processes, batched across clients\n");
+    fprintf(stderr, "  %s daemon-filter <socket path> <encrypt|decrypt> <mode> <key hex> [iv hex]\n", program);
+    fprintf(stderr, "      send stdin to a running daemon and write the result to stdout, without padding\n");
+#endif
+    fprintf(stderr, "  %s bench-scaling [max threads] [compact|scatter|numa|all] [MiB]\n", program);
+    fprintf(stderr, "      throughput and parallel efficiency of ECB, CTR and CBC decryption at 1..N threads\n");
+    fprintf(stderr, "  %s bench-baseline save <file> [max threads] [runs] [MiB]\n", program);
+    fprintf(stderr, "      measure every engine, mode, size and thread count and store the results as JSON\n");
+    fprintf(stderr, "  %s bench-baseline compare <file> [threshold %%] [runs] [MiB]\n", program);
+    fprintf(stderr, "      re-measure a stored baseline, exit 1 on regressions beyond the threshold (default 5)\n");
+    fprintf(stderr, "  %s rounds-stats <rounds> <key hex> <difference hex> [million pairs] [threads]\n", program);
+    fprintf(stderr, "      per-round S-Box activity of pairs with the given difference through reduced-round DES\n");
+    fprintf(stderr, "  %s inplace-check\n", program);
+    fprintf(stderr, "      check in-place and shifted operation of every mode against separate buffers\n");
+    fprintf(stderr, "  %s container-check\n", program);
+    fprintf(stderr, "      round-trip the seekable container and read byte ranges back, reject damaged indexes\n");
+    fprintf(stderr, "  %s key-setup-check\n", program);
+    fprintf(stderr, "      compare bulk key setup and bulk key cache lookups with des_key_setup over random keys\n");
+    fprintf(stderr, "  %s async-check\n", program);
+    fprintf(stderr, "      await encryptions, segmented progress and cancellation against the synchronous path (needs C++20)\n");
+    fprintf(stderr, "  %s alloc-check\n", program);
+    fprintf(stderr, "      fail if the steady-state encrypt path allocates (needs DES_ALLOC_TRACKING=1)\n");
+}
+
+
+/// <summary>
+/// Runs the command given on the command line.
+/// </summary>
+/// <returns>Process exit code</returns>
+int run_command_line(int argc, char* argv[]) {
+    if (strcmp(argv[1], "filter") == 0 && (argc == 5 || argc == 6)) {
+        unsigned char key[BLOCK_BYTES], iv[BLOCK_BYTES] = { 0 };
+        int decrypt = strcmp(argv[2], "decrypt") == 0;
+        int mode = parse_mode(argv[3]);
+        if ((!decrypt && strcmp(argv[2], "encrypt") != 0) || mode < 0 || parse_hex_bytes(argv[4], key, BLOCK_BYTES) != 0
+            || (argc == 6 && parse_hex_bytes(argv[5], iv, BLOCK_BYTES) != 0)) {
+            print_usage(argv[0]);
+            return 1;
+        }
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        des_key_schedule schedule;
+        des_key_setup(key, &schedule);
+        return stream_filter(stdin, stdout, &schedule, mode, iv, decrypt) == 0 ? 0 : 1;
+    }
+
+#if DES_HAS_DAEMON
+    if (strcmp(argv[1], "daemon") == 0 && argc >= 3 && argc <= 5) {
+        int window_us = argc > 3 ? atoi(argv[3]) : DAEMON_DEFAULT_WINDOW_US;
+        int threads = argc > 4 ? atoi(argv[4]) : 0;
+        if (window_us < 0 || threads < 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_daemon(argv[2], window_us, threads);
+    }
+
+    if (strcmp(argv[1], "daemon-filter") == 0 && (argc == 6 || argc == 7)) {
+        unsigned char key[BLOCK_BYTES], iv[BLOCK_BYTES] = { 0 };
+        int decrypt = strcmp(argv[3], "decrypt") == 0;
+        int mode = parse_mode(argv[4]);
+        if ((!decrypt && strcmp(argv[3], "encrypt") != 0) || mode < 0 || parse_hex_bytes(argv[5], key, BLOCK_BYTES) != 0
+            || (argc == 7 && parse_hex_bytes(argv[6], iv, BLOCK_BYTES) != 0)) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_daemon_filter(argv[2], decrypt, mode, key, iv);
+    }
+#endif
+
+    if (strcmp(argv[1], "bench-scaling") == 0 && argc <= 5) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : 0;
+        int policy = -1;
+        for (int p = 0; argc > 3 && p < 3; p++) {
+            if (strcmp(argv[3], bench_policy_names[p]) == 0) {
+                policy = p;
+            }
+        }
+        int mebibytes = argc > 4 ? atoi(argv[4]) : 16;
+        if ((argc > 3 && policy < 0 && strcmp(argv[3], "all") != 0) || mebibytes <= 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_scaling_benchmark(max_threads, policy, (size_t)mebibytes << 20);
+    }
+
+    if (strcmp(argv[1], "bench-baseline") == 0 && argc >= 4 && argc <= 7) {
+        int save = strcmp(argv[2], "save") == 0;
+        int runs = argc > 5 ? atoi(argv[5]) : (save ? 7 : 0);
+        int mebibytes = argc > 6 ? atoi(argv[6]) : 8;
+        double threshold = !save && argc > 4 ? atof(argv[4]) : 5.0;
+        if ((!save && strcmp(argv[2], "compare") != 0) || runs < 0 || runs > BASELINE_MAX_RUNS || (save && runs == 0)
+            || mebibytes <= 0 || threshold <= 0) {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (save) {
+            return run_baseline_save(argv[3], argc > 4 ? atoi(argv[4]) : 0, runs, (size_t)mebibytes << 20);
+        }
+        return run_baseline_compare(argv[3], threshold, runs, (size_t)mebibytes << 20);
+    }
+
+    if (strcmp(argv[1], "rounds-stats") == 0 && argc >= 5 && argc <= 7) {
+        unsigned char key[BLOCK_BYTES], difference[BLOCK_BYTES];
+        int rounds = atoi(argv[2]);
+        double millions = argc > 5 ? atof(argv[5]) : 1.0;
+        int threads = argc > 6 ? atoi(argv[6]) : 0;
+        if (rounds < 1 || rounds > QUARTER_NUM_BITS || parse_hex_bytes(argv[3], key, BLOCK_BYTES) != 0
+            || parse_hex_bytes(argv[4], difference, BLOCK_BYTES) != 0 || millions <= 0 || threads < 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_rounds_stats(key, rounds, load_be64(difference), (uint64_t)(millions * 1e6), threads);
+    }
+
+    if (strcmp(argv[1], "inplace-check") == 0 && argc == 2) {
+        return run_inplace_check();
+    }
+
+    if (strcmp(argv[1], "container-check") == 0 && argc == 2) {
+        return run_container_check();
+    }
+
+    if (strcmp(argv[1], "key-setup-check") == 0 && argc == 2) {
+        return run_key_setup_check();
+    }
+
+    if (strcmp(argv[1], "async-check") == 0 && argc == 2) {
+        return run_async_check();
+    }
+
+    if (strcmp(argv[1], "alloc-check") == 0 && argc == 2) {
+        return run_alloc_check();
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return run_command_line(argc, argv);
+    }
+
     //// -----------------------variables initialization part-----------------------
     int size_of_data = 0, chunks;
     char* data = (char*)"hello world!";
@@ -951,37 +7463,37 @@ int main() {
     char* key = (char*)"NVJdqu12";
     key = get_ascii_hex(key);
 
-    char* c0_key = (char*)malloc(REDUCTION_HALF_NUM_BITS + 1);
-    char* d0_key = (char*)malloc(REDUCTION_HALF_NUM_BITS + 1);
+    char* c0_key = (char*)des_malloc(REDUCTION_HALF_NUM_BITS + 1);
+    char* d0_key = (char*)des_malloc(REDUCTION_HALF_NUM_BITS + 1);
     if (c0_key == NULL || d0_key == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return 1;
     }
 
-    char** c_keys_arr = (char**)malloc(QUARTER_NUM_BITS);
-    char** d_keys_arr = (char**)malloc(QUARTER_NUM_BITS);
+    char** c_keys_arr = (char**)des_malloc(QUARTER_NUM_BITS);
+    char** d_keys_arr = (char**)des_malloc(QUARTER_NUM_BITS);
     if (c_keys_arr == NULL || d_keys_arr == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return 1;
     }
 
     for (int i = 0; i < QUARTER_NUM_BITS; i++) {
-        c_keys_arr[i] = (char*)malloc(REDUCTION_HALF_NUM_BITS);
-        d_keys_arr[i] = (char*)malloc(REDUCTION_HALF_NUM_BITS);
+        c_keys_arr[i] = (char*)des_malloc(REDUCTION_HALF_NUM_BITS);
+        d_keys_arr[i] = (char*)des_malloc(REDUCTION_HALF_NUM_BITS);
         if (c_keys_arr[i] == NULL || d_keys_arr[i] == NULL) {
             fprintf(stderr, "Memory allocation failed.\n");
             return 1;
         }
     }
 
-    char** keys_arr = (char**)malloc(QUARTER_NUM_BITS);
+    char** keys_arr = (char**)des_malloc(QUARTER_NUM_BITS);
     if (keys_arr == NULL) {
         fprintf(stderr, "Memory allocation failed.\n");
         return 1;
     }
 
     for (int i = 0; i < QUARTER_NUM_BITS; i++) {
-        keys_arr[i] = (char*)malloc(REDUCTION_HALF_NUM_BITS);
+        keys_arr[i] = (char*)des_malloc(REDUCTION_HALF_NUM_BITS);
         if (keys_arr[i] == NULL) {
             fprintf(stderr, "Memory allocation failed.\n");
             return 1;
@@ -1068,16 +7580,16 @@ int main() {
 
 
     //free all and avoid memory leaks
-    free(binary_key);
-    free(pc1_key);
-    free(c0_key);
-    free(d0_key);
+    des_free(binary_key);
+    des_free(pc1_key);
+    des_free(c0_key);
+    des_free(d0_key);
     for (int i = 0; i < QUARTER_NUM_BITS; i++) {
-        free(c_keys_arr[i]);
-        free(d_keys_arr[i]);
+        des_free(c_keys_arr[i]);
+        des_free(d_keys_arr[i]);
     }
-    free(c_keys_arr);
-    free(d_keys_arr);
+    des_free(c_keys_arr);
+    des_free(d_keys_arr);
     free_keys_array(keys_arr, QUARTER_NUM_BITS);
     free_keys_array(pc2_keys_arr, QUARTER_NUM_BITS);
     return 0;